@@ -0,0 +1,466 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "metis.h"
+#include "format.h"
+#include "numa.h"
+#include "util.h"
+
+// Pick ELL when padding every row to the longest one stores at most this much more than the
+// model, and SELL when its padding stays below the second ratio. Otherwise rows stay as they are
+#define METIS_ELL_PADDING 1.25
+#define METIS_SELL_PADDING 1.5
+// Pick the blocked format when the activity levels of the model are this many times larger than
+// the last level cache, so most inputs would miss it
+#define METIS_BLOCKED_CACHE_RATIO 4
+// Assumed when the system does not tell how large its last level cache is
+#define METIS_DEFAULT_CACHE (32 * 1024 * 1024)
+// Full updates timed per format by the benchmark
+#define METIS_BENCHMARK_ROUNDS 20
+
+static int metisDegree(const metisModel* model, int neuron) {
+	return model->connectionOffsets[neuron + 1] - model->connectionOffsets[neuron];
+}
+
+// Longest rows first, rows of the same length keep their order
+static int metisCompareRows(const void* a, const void* b) {
+	const int* left = a;
+	const int* right = b;
+
+	if (left[0] != right[0]) {
+		return left[0] > right[0] ? -1 : 1;
+	}
+	return left[1] < right[1] ? -1 : left[1] > right[1];
+}
+
+// Sort every window of sigma rows of a block by length, pairs hold the length and the row
+static void metisSortWindows(const metisModel* model, const int* nodes, const metisBlock* block, int* pairs) {
+	for (int k = block->first; k < block->last; k++) {
+		pairs[(k - block->first) * 2] = metisDegree(model, nodes[k]);
+		pairs[(k - block->first) * 2 + 1] = k;
+	}
+	for (int window = block->first; window < block->last; window += METIS_SELL_SIGMA) {
+		int length = block->last - window < METIS_SELL_SIGMA ? block->last - window : METIS_SELL_SIGMA;
+		qsort(&pairs[(window - block->first) * 2], length, sizeof(int) * 2, metisCompareRows);
+	}
+}
+
+// Lay out the slices of every neuron run, or only count them if the matrix has no storage yet.
+// An ELL block is one slice as wide as the longest row of the worker, SELL cuts the sorted
+// windows of a block into slices of METIS_SELL_HEIGHT rows as wide as their longest row.
+// The entries themselves are left to metisFillMatrixBlock
+static void metisLayoutSlices(metisMatrix* matrix, const metisModel* model, const int* nodes, const metisScheduler* scheduler, int ellWidth, int* pairs) {
+	bool fill = matrix->rows != NULL;
+	int slice = 0;
+	int row = 0;
+	long long entries = 0;
+
+	for (int b = 0; b < scheduler->blockLength; b++) {
+		const metisBlock* block = &scheduler->blocks[b];
+		if (fill) {
+			matrix->blockSlices[b] = slice;
+		}
+		if (block->hub != -1) {
+			continue;
+		}
+
+		int blockLength = block->last - block->first;
+		if (matrix->format == METIS_FORMAT_SELL) {
+			metisSortWindows(model, nodes, block, pairs);
+		}
+		else {
+			for (int k = block->first; k < block->last; k++) {
+				pairs[(k - block->first) * 2] = ellWidth;
+				pairs[(k - block->first) * 2 + 1] = k;
+			}
+		}
+
+		int sliceHeight = matrix->format == METIS_FORMAT_SELL ? METIS_SELL_HEIGHT : blockLength;
+		for (int first = 0; first < blockLength; first += sliceHeight) {
+			int height = blockLength - first < sliceHeight ? blockLength - first : sliceHeight;
+			int width = 0;
+			for (int r = 0; r < height; r++) {
+				width = pairs[(first + r) * 2] > width ? pairs[(first + r) * 2] : width;
+			}
+
+			if (fill) {
+				matrix->sliceOffsets[slice] = (int)entries;
+				matrix->sliceHeights[slice] = height;
+				matrix->sliceWidths[slice] = width;
+				matrix->rowOffsets[slice] = row;
+				for (int r = 0; r < height; r++) {
+					int k = pairs[(first + r) * 2 + 1];
+					matrix->rows[row + r] = k;
+					matrix->connections += metisDegree(model, nodes[k]);
+				}
+			}
+
+			slice++;
+			row += height;
+			entries += (long long)height * width;
+		}
+	}
+
+	if (fill) {
+		matrix->blockSlices[scheduler->blockLength] = slice;
+	}
+	matrix->sliceLength = slice;
+	matrix->entries = entries;
+}
+
+static long metisCacheSize() {
+	long size = sysconf(_SC_LEVEL3_CACHE_SIZE);
+	if (size <= 0) {
+		size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+	}
+	return size > 0 ? size : METIS_DEFAULT_CACHE;
+}
+
+// Sort the inputs of the neuron runs by source and work out which bin slot every product goes
+// to. Within a bin the products keep the order of the stream, so the bins fill up front to back
+static void metisLayoutBlocked(metisMatrix* matrix, const metisModel* model, const int* nodes, const metisScheduler* scheduler, bool hugePages) {
+	int length = scheduler->blockLength > 0 ? scheduler->blocks[scheduler->blockLength - 1].last : 0;
+
+	// Hubs are summed up from their own products and neurons outside the blocks elsewhere, they have no slots
+	int* bins = malloc(sizeof(int) * (length + 1));
+	for (int k = 0; k < length; k++) {
+		bins[k] = -1;
+	}
+	for (int b = 0; b < scheduler->blockLength; b++) {
+		const metisBlock* block = &scheduler->blocks[b];
+		for (int k = block->first; k < block->last; k++) {
+			bins[k] = block->hub == -1 ? b : -1;
+		}
+	}
+
+	matrix->slotOffsets = malloc(sizeof(int) * (length + 1));
+	matrix->slotOffsets[0] = 0;
+	for (int k = 0; k < length; k++) {
+		matrix->slotOffsets[k + 1] = matrix->slotOffsets[k] + (bins[k] != -1 ? metisDegree(model, nodes[k]) : 0);
+	}
+	int entries = matrix->slotOffsets[length];
+
+	// The slots of a block are contiguous, so its bin covers the same range
+	matrix->binOffsets = malloc(sizeof(int) * (scheduler->blockLength + 1));
+	for (int b = 0; b < scheduler->blockLength; b++) {
+		matrix->binOffsets[b] = matrix->slotOffsets[scheduler->blocks[b].first];
+	}
+	matrix->binOffsets[scheduler->blockLength] = entries;
+
+	int* sourceOffsets = calloc(model->neuronLength + 1, sizeof(int));
+	for (int k = 0; k < length; k++) {
+		for (int connection = model->connectionOffsets[nodes[k]]; bins[k] != -1 && connection < model->connectionOffsets[nodes[k] + 1]; connection++) {
+			sourceOffsets[model->connectionSources[connection] + 1]++;
+		}
+	}
+	for (int neuron = 0; neuron < model->neuronLength; neuron++) {
+		sourceOffsets[neuron + 1] += sourceOffsets[neuron];
+	}
+
+	matrix->weights = metisAllocLarge(sizeof(double) * (entries + 1), hugePages);
+	matrix->sources = metisAllocLarge(sizeof(int) * (entries + 1), hugePages);
+	matrix->targets = metisAllocLarge(sizeof(int) * (entries + 1), hugePages);
+	matrix->binSlots = metisAllocLarge(sizeof(int) * (entries + 1), hugePages);
+	matrix->binValues = metisAllocLarge(sizeof(double) * (entries + 1), hugePages);
+	matrix->slots = metisAllocLarge(sizeof(double) * (entries + 1), hugePages);
+
+	// Walking the rows in order lists the entries of every source by neuron
+	int* entryRows = malloc(sizeof(int) * (entries + 1));
+	int* entrySlots = malloc(sizeof(int) * (entries + 1));
+	for (int k = 0; k < length; k++) {
+		if (bins[k] == -1) {
+			continue;
+		}
+
+		int connFirst = model->connectionOffsets[nodes[k]];
+		for (int j = 0; j < metisDegree(model, nodes[k]); j++) {
+			int source = model->connectionSources[connFirst + j];
+			int entry = sourceOffsets[source]++;
+
+			matrix->weights[entry] = model->connectionSensitivities[connFirst + j];
+			matrix->sources[entry] = source;
+			entryRows[entry] = k;
+			entrySlots[entry] = matrix->slotOffsets[k] + j;
+		}
+	}
+
+	int* cursors = malloc(sizeof(int) * (scheduler->blockLength + 1));
+	memcpy(cursors, matrix->binOffsets, sizeof(int) * (scheduler->blockLength + 1));
+	for (int entry = 0; entry < entries; entry++) {
+		int target = cursors[bins[entryRows[entry]]]++;
+		matrix->targets[entry] = target;
+		matrix->binSlots[target] = entrySlots[entry];
+	}
+
+	matrix->entries = entries;
+	matrix->connections = entries;
+	free(cursors);
+	free(entryRows);
+	free(entrySlots);
+	free(sourceOffsets);
+	free(bins);
+}
+
+// Lay out the neuron runs of a scheduler in a format. METIS_FORMAT_AUTO keeps rows of very
+// different length as they are and prefers the format that needs less padding otherwise. Models
+// whose activity levels do not fit in the last level cache are blocked.
+// The entries are not written yet, every block has to be filled with metisFillMatrixBlock
+// by the thread that will update it, so its pages end up on the socket of that thread
+metisMatrix* metisNewMatrix(const metisModel* model, const int* nodes, const metisScheduler* scheduler, int format, bool hugePages) {
+	metisMatrix* matrix = calloc(1, sizeof(metisMatrix));
+	int longest = 0;
+	int rowLength = 0;
+	int rowCount = 0;
+	long long connections = 0;
+
+	for (int b = 0; b < scheduler->blockLength; b++) {
+		const metisBlock* block = &scheduler->blocks[b];
+		if (block->hub != -1) {
+			continue;
+		}
+
+		rowLength = block->last - block->first > rowLength ? block->last - block->first : rowLength;
+		rowCount += block->last - block->first;
+		for (int k = block->first; k < block->last; k++) {
+			int degree = metisDegree(model, nodes[k]);
+			longest = degree > longest ? degree : longest;
+			connections += degree;
+		}
+	}
+
+	int* pairs = malloc(sizeof(int) * 2 * (rowLength + 1));
+	if (format == METIS_FORMAT_AUTO) {
+		matrix->format = METIS_FORMAT_SELL;
+		metisLayoutSlices(matrix, model, nodes, scheduler, longest, pairs);
+		long long sellEntries = matrix->entries;
+		matrix->format = METIS_FORMAT_ELL;
+		metisLayoutSlices(matrix, model, nodes, scheduler, longest, pairs);
+		long long ellEntries = matrix->entries;
+
+		format = METIS_FORMAT_CSR;
+		if ((long long)(sizeof(int) * model->neuronLength) > (long long)metisCacheSize() * METIS_BLOCKED_CACHE_RATIO) {
+			format = METIS_FORMAT_BLOCKED;
+		}
+		else if (ellEntries <= connections * METIS_ELL_PADDING) {
+			format = METIS_FORMAT_ELL;
+		}
+		else if (sellEntries <= connections * METIS_SELL_PADDING) {
+			format = METIS_FORMAT_SELL;
+		}
+	}
+
+	matrix->format = format;
+	if (format == METIS_FORMAT_BLOCKED) {
+		metisLayoutBlocked(matrix, model, nodes, scheduler, hugePages);
+	}
+	else if (format != METIS_FORMAT_CSR) {
+		metisLayoutSlices(matrix, model, nodes, scheduler, longest, pairs);
+		matrix->sliceOffsets = malloc(sizeof(int) * (matrix->sliceLength + 1));
+		matrix->sliceHeights = malloc(sizeof(int) * (matrix->sliceLength + 1));
+		matrix->sliceWidths = malloc(sizeof(int) * (matrix->sliceLength + 1));
+		matrix->rowOffsets = malloc(sizeof(int) * (matrix->sliceLength + 1));
+		matrix->weights = metisAllocLarge(sizeof(double) * (matrix->entries + 1), hugePages);
+		matrix->sources = metisAllocLarge(sizeof(int) * (matrix->entries + 1), hugePages);
+		matrix->blockSlices = malloc(sizeof(int) * (scheduler->blockLength + 1));
+		matrix->rows = malloc(sizeof(int) * (rowCount + 1));
+		metisLayoutSlices(matrix, model, nodes, scheduler, longest, pairs);
+	}
+	else {
+		matrix->sliceLength = 0;
+		matrix->entries = connections;
+		matrix->connections = connections;
+	}
+	free(pairs);
+
+	return matrix;
+}
+
+// Write the entries of the slices of one block, nothing to do for CSR. The entries of the blocked
+// format are in source order, only the bin and the slots of the block belong to it
+void metisFillMatrixBlock(metisMatrix* matrix, const metisModel* model, const int* nodes, int index) {
+	if (matrix->format == METIS_FORMAT_CSR) {
+		return;
+	}
+	if (matrix->format == METIS_FORMAT_BLOCKED) {
+		int first = matrix->binOffsets[index];
+		int last = matrix->binOffsets[index + 1];
+		memset(&matrix->binValues[first], 0, sizeof(double) * (last - first));
+		memset(&matrix->slots[first], 0, sizeof(double) * (last - first));
+		return;
+	}
+
+	for (int slice = matrix->blockSlices[index]; slice < matrix->blockSlices[index + 1]; slice++) {
+		int height = matrix->sliceHeights[slice];
+		int width = matrix->sliceWidths[slice];
+		double* weights = &matrix->weights[matrix->sliceOffsets[slice]];
+		int* sources = &matrix->sources[matrix->sliceOffsets[slice]];
+
+		for (int r = 0; r < height; r++) {
+			int neuron = nodes[matrix->rows[matrix->rowOffsets[slice] + r]];
+			int connFirst = model->connectionOffsets[neuron];
+			int degree = metisDegree(model, neuron);
+
+			for (int j = 0; j < width; j++) {
+				weights[j * height + r] = j < degree ? model->connectionSensitivities[connFirst + j] : 0;
+				sources[j * height + r] = j < degree ? model->connectionSources[connFirst + j] : 0;
+			}
+		}
+	}
+}
+
+// Stream the share of a thread of the blocked entries into the bins. Every thread of the update
+// has to be done with its share before the first block is calculated
+void metisMatrixScatter(const metisMatrix* matrix, const int* activityLevel, int thread, int threadLength) {
+	int first;
+	int last;
+
+	if (matrix->format != METIS_FORMAT_BLOCKED) {
+		return;
+	}
+
+	metisPoolRange((int)matrix->entries, thread, threadLength, &first, &last);
+	for (int entry = first; entry < last; entry++) {
+		matrix->binValues[matrix->targets[entry]] = matrix->weights[entry] * activityLevel[matrix->sources[entry]];
+	}
+}
+
+// Calculate the next activity level of every neuron of a run into nextValue, indexed by neuron
+void metisMatrixBlock(const metisMatrix* matrix, const metisModel* model, const int* nodes, const metisBlock* block, int index, const int* activityLevel, int* nextValue) {
+	int values[METIS_KERNEL_BATCH];
+
+	if (matrix->format == METIS_FORMAT_CSR) {
+		for (int k = block->first; k < block->last; k += METIS_KERNEL_BATCH) {
+			int length = block->last - k < METIS_KERNEL_BATCH ? block->last - k : METIS_KERNEL_BATCH;
+			metisCalculateNeurons(model, activityLevel, &nodes[k], length, values);
+			for (int i = 0; i < length; i++) {
+				nextValue[nodes[k + i]] = values[i];
+			}
+		}
+		return;
+	}
+
+	// Put the products of the bin in input order, then add up every row like the kernels do
+	if (matrix->format == METIS_FORMAT_BLOCKED) {
+		for (int i = matrix->binOffsets[index]; i < matrix->binOffsets[index + 1]; i++) {
+			matrix->slots[matrix->binSlots[i]] = matrix->binValues[i];
+		}
+		for (int k = block->first; k < block->last; k++) {
+			double total = 0;
+			for (int slot = matrix->slotOffsets[k]; slot < matrix->slotOffsets[k + 1]; slot++) {
+				total += matrix->slots[slot];
+			}
+			nextValue[nodes[k]] = total <= 10 ? (int)total : 10;
+		}
+		return;
+	}
+
+	for (int slice = matrix->blockSlices[index]; slice < matrix->blockSlices[index + 1]; slice++) {
+		int height = matrix->sliceHeights[slice];
+		const int* rows = &matrix->rows[matrix->rowOffsets[slice]];
+
+		// Tall ELL slices are handed over a batch of rows at a time
+		for (int first = 0; first < height; first += METIS_KERNEL_BATCH) {
+			int length = height - first < METIS_KERNEL_BATCH ? height - first : METIS_KERNEL_BATCH;
+			metisCalculateSlice(&matrix->weights[matrix->sliceOffsets[slice] + first], &matrix->sources[matrix->sliceOffsets[slice] + first],
+				height, length, matrix->sliceWidths[slice], activityLevel, values);
+			for (int r = 0; r < length; r++) {
+				nextValue[nodes[rows[first + r]]] = values[r];
+			}
+		}
+	}
+}
+
+const char* metisFormatName(int format) {
+	switch (format) {
+	case METIS_FORMAT_CSR:
+		return "csr";
+	case METIS_FORMAT_ELL:
+		return "ell";
+	case METIS_FORMAT_SELL:
+		return "sell";
+	case METIS_FORMAT_BLOCKED:
+		return "blocked";
+	default:
+		return "auto";
+	}
+}
+
+void metisFreeMatrix(metisMatrix* matrix) {
+	free(matrix->sliceOffsets);
+	free(matrix->sliceHeights);
+	free(matrix->sliceWidths);
+	free(matrix->rowOffsets);
+	free(matrix->rows);
+	free(matrix->weights);
+	free(matrix->sources);
+	free(matrix->blockSlices);
+	free(matrix->targets);
+	free(matrix->binOffsets);
+	free(matrix->binSlots);
+	free(matrix->binValues);
+	free(matrix->slotOffsets);
+	free(matrix->slots);
+	free(matrix);
+}
+
+// Time a full update of every neuron of the model in each format on one thread and print
+// the throughput. Hubs are left to the scheduler in a simulation, so they are not split here
+void metisBenchmarkFormats(const metisModel* model) {
+	int* nodes = malloc(sizeof(int) * (model->neuronLength + 1));
+	int* activityLevel = malloc(sizeof(int) * (model->neuronLength + 1));
+	int* reference = malloc(sizeof(int) * (model->neuronLength + 1));
+	int* nextValue = malloc(sizeof(int) * (model->neuronLength + 1));
+
+	// Every activity level from 0 to 10 shows up, spread over the model
+	for (int neuron = 0; neuron < model->neuronLength; neuron++) {
+		nodes[neuron] = neuron;
+		activityLevel[neuron] = (int)((neuron * 2654435761u) % 11);
+	}
+
+	// One run per block keeps the rows of the formats comparable
+	int* costs = malloc(sizeof(int) * (model->neuronLength + 1));
+	for (int neuron = 0; neuron < model->neuronLength; neuron++) {
+		costs[neuron] = 0;
+	}
+	metisScheduler* scheduler = metisNewScheduler(costs, model->neuronLength, 1, false);
+	free(costs);
+
+	fprintf(stderr, "Benchmarking %d neurons with %d inputs, %s kernel, %d rounds\n", model->neuronLength, model->connectionLength, metisKernelName(), METIS_BENCHMARK_ROUNDS);
+	for (int format = METIS_FORMAT_CSR; format <= METIS_FORMAT_BLOCKED; format++) {
+		metisMatrix* matrix = metisNewMatrix(model, nodes, scheduler, format, false);
+		for (int b = 0; b < scheduler->blockLength; b++) {
+			metisFillMatrixBlock(matrix, model, nodes, b);
+		}
+
+		double start = metisSeconds();
+		for (int round = 0; round < METIS_BENCHMARK_ROUNDS; round++) {
+			metisMatrixScatter(matrix, activityLevel, 0, 1);
+			for (int b = 0; b < scheduler->blockLength; b++) {
+				metisMatrixBlock(matrix, model, nodes, &scheduler->blocks[b], b, activityLevel, nextValue);
+			}
+		}
+		double seconds = metisSeconds() - start;
+
+		int mismatches = 0;
+		for (int neuron = 0; neuron < model->neuronLength; neuron++) {
+			if (format == METIS_FORMAT_CSR) {
+				reference[neuron] = nextValue[neuron];
+			}
+			else if (reference[neuron] != nextValue[neuron]) {
+				mismatches++;
+			}
+		}
+
+		fprintf(stderr, "%-7s %10.2f M inputs/s, %.2f entries per input, %d neurons differ from csr\n", metisFormatName(format),
+			seconds > 0 ? (double)matrix->connections * METIS_BENCHMARK_ROUNDS / seconds * 1e-6 : 0,
+			matrix->connections > 0 ? (double)matrix->entries / matrix->connections : 0, mismatches);
+		metisFreeMatrix(matrix);
+	}
+
+	metisFreeScheduler(scheduler);
+	free(nodes);
+	free(activityLevel);
+	free(reference);
+	free(nextValue);
+}
@@ -0,0 +1,56 @@
+#ifndef METIS_FORMAT_H
+#define METIS_FORMAT_H
+
+#include "schedule.h"
+
+// Storage formats of the inputs of the neurons a worker owns
+#define METIS_FORMAT_CSR 0					// the rows of the model as they are
+#define METIS_FORMAT_ELL 1					// every row padded to the longest one
+#define METIS_FORMAT_SELL 2					// rows sorted by length in windows of sigma, padded per slice of C
+#define METIS_FORMAT_BLOCKED 3				// inputs streamed in source order into bins per block (propagation blocking)
+#define METIS_FORMAT_AUTO 4					// picked from the degree statistics and the cache size
+
+// SELL-C-sigma parameters, a slice is as high as the widest kernel
+#define METIS_SELL_HEIGHT 8
+#define METIS_SELL_SIGMA 128
+
+struct metisModel;
+
+// The inputs of the neuron runs of a scheduler, cut into slices. The entries of a slice are
+// stored column by column, entry j of row r at sliceOffsets[s] + j * sliceHeights[s] + r.
+// Short rows are padded with a weight of 0, so every row still adds up its inputs in order.
+//
+// The blocked format keeps the entries sorted by source instead. Every time step they are
+// streamed once, reading the activity levels in order, and each product is appended to the
+// bin of the block its neuron belongs to. A block then places the products of its bin in
+// input order and adds up its rows, with all of its products in cache
+typedef struct metisMatrix {
+	int format;
+	int sliceLength;
+	int* sliceOffsets;
+	int* sliceHeights;
+	int* sliceWidths;
+	int* rowOffsets;						// per slice, its rows are rows[rowOffsets[s] ... rowOffsets[s] + sliceHeights[s]]
+	int* rows;								// owned neuron of every row
+	double* weights;
+	int* sources;
+	int* blockSlices;						// per scheduler block, its slices are blockSlices[b] ... blockSlices[b + 1]
+	long long entries;						// stored entries, padding included
+	long long connections;					// inputs covered by the slices
+	int* targets;							// blocked, per entry, where its product goes in binValues
+	int* binOffsets;						// blocked, per scheduler block, its bin is binValues[binOffsets[b] ... binOffsets[b + 1]]
+	int* binSlots;							// blocked, per bin entry, the slot of its product
+	double* binValues;
+	int* slotOffsets;						// blocked, per owned neuron, its products are slots[slotOffsets[k] ... slotOffsets[k + 1]]
+	double* slots;
+} metisMatrix;
+
+metisMatrix* metisNewMatrix(const struct metisModel*, const int*, const metisScheduler*, int, bool);
+void metisFillMatrixBlock(metisMatrix*, const struct metisModel*, const int*, int);
+void metisMatrixScatter(const metisMatrix*, const int*, int, int);
+void metisMatrixBlock(const metisMatrix*, const struct metisModel*, const int*, const metisBlock*, int, const int*, int*);
+const char* metisFormatName(int);
+void metisFreeMatrix(metisMatrix*);
+void metisBenchmarkFormats(const struct metisModel*);
+
+#endif
@@ -0,0 +1,1240 @@
+#include <mpi.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "metis.h"
+#include "ring.h"
+
+// Push instead of pull when scattering the changed inputs, and gathering the inputs of neurons
+// whose products are out of date, touches less than 1 / METIS_PUSH_RATIO of the edges a pull would
+#define METIS_PUSH_RATIO 2
+
+// Values exchanged with one worker on another host every time step
+typedef struct metisHaloPeer {
+	int rank;
+	int length;
+	int* neurons;							// neurons exchanged, in id order
+	int* buffers[2];						// per time step parity, the time step followed by the values of every
+											// position, lane by lane. With an active set the time step, the
+											// number of changes and (position, value) pairs
+	MPI_Request requests[2];
+	int filled;								// values written into the send buffer of the next time step
+	int capacity;							// size of a buffer
+} metisHaloPeer;
+
+// An edge range of a split hub I calculate. Its products go straight into place if the hub is
+// mine, otherwise they are sent to the owner of the hub every time step
+typedef struct metisCutPart {
+	int neuron;
+	int first;								// first input of the range
+	int last;								// one past the last input of the range
+	int owner;
+	double* products;						// per input of the range, its weighted activity, lane by lane
+	MPI_Request request;
+} metisCutPart;
+
+// The halo plan of a worker and the state shared by its communication and compute threads
+typedef struct metisHalo {
+	metisWorker* worker;
+	metisHaloPeer* producers;				// workers on other hosts owning inputs of my neurons
+	int producerLength;
+	metisHaloPeer* consumers;				// workers on other hosts with inputs I own
+	int consumerLength;
+	int* localGhosts;						// inputs owned by workers on my host, read from their slices
+	int localGhostLength;
+	int* sendOffsets;						// per owned neuron, its targets are sendTargets[sendOffsets[k] ... sendOffsets[k + 1]]
+	int* sendTargets;						// pairs of consumer and position in its buffer
+	bool* stimulated;						// per owned neuron and lane, a stimulus sets it in the next time step
+	metisRing* rings;						// per compute thread, finished values for the communication thread,
+											// keyed by owned neuron and lane
+	int computeThreads;
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	int readyTime;							// last time step whose inputs are all in place
+	pthread_barrier_t barrier;
+	bool active;							// only recalculate neurons with an input that changed
+	bool* stimulatedNow;					// per owned neuron, a stimulus set it in the current time step
+	int* successorOffsets;					// per neuron, the owned neurons it is an input of are
+	int* successors;						// successors[successorOffsets[i] ... successorOffsets[i + 1]]
+	int* successorConnections;				// per successor, the connection from the input
+	int direction;							// METIS_PULL, METIS_PUSH or METIS_AUTO
+	bool push;								// the current time step scatters the changed inputs
+	int* productOffsets;					// per owned neuron, the products of its inputs are
+	double* products;						// products[productOffsets[k] ... productOffsets[k + 1]], in input order
+	bool* fresh;							// per owned neuron, its products belong to the current inputs
+	int* changedInputs;						// neurons whose value changed for the current time step
+	int changedInputLength;
+	long long scatterEdges;					// edges from the changed inputs
+	long long gatherEdges;					// inputs of the neurons on the visit list
+	long long staleEdges;					// inputs of the neurons on the visit list that are not fresh
+	int pushSteps;
+	int* visitStamp;						// per owned neuron, the last time step it was put on the visit list
+	int* visit;								// owned neurons to recalculate in the current time step
+	int visitLength;
+	int* changes;							// pairs of owned neuron and its new value for the next time step
+	int changeLength;
+	long long visited;						// neurons recalculated over the whole simulation
+	int* cutHubs;							// owned neurons whose inputs are split over several workers
+	int cutHubLength;
+	int* cutProductOffsets;					// per split hub, the products of its inputs start at input cutProductOffsets[h]
+	double* cutProducts;					// of all split hubs, input by input and lane by lane
+	metisCutPart* parts;					// edge ranges of split hubs I calculate
+	int partLength;
+	int* cutSources;						// per range of my split hubs calculated elsewhere, hub, first, last and worker
+	MPI_Request* cutRequests;
+	int cutSourceLength;
+	int cutReadyTime;						// last time step whose split hubs have all of their products
+	bool* replicated;						// per neuron, its value goes to every worker each time step
+	int* replicas;							// replicated neurons by owner and id, the order they are gathered in
+	int replicaLength;
+	int* replicaCounts;						// per worker, the values it adds to the gather, lane by lane
+	int* replicaDisplacements;
+	int* replicaSend;
+	int* replicaValues;
+	MPI_Request replicaRequest;
+} metisHalo;
+
+static int metisComparePairs(const void* a, const void* b) {
+	const int* left = a;
+	const int* right = b;
+
+	if (left[0] != right[0]) {
+		return left[0] < right[0] ? -1 : 1;
+	}
+	return left[1] < right[1] ? -1 : left[1] > right[1];
+}
+
+// Turn (rank, neuron) pairs sorted by rank and then neuron into one peer per rank
+static metisHaloPeer* metisNewPeers(const int* pairs, int pairLength, int lanes, int* peerLength) {
+	metisHaloPeer* peers = malloc(sizeof(metisHaloPeer) * (pairLength + 1));
+	int length = 0;
+
+	for (int i = 0; i < pairLength; i++) {
+		if (length == 0 || peers[length - 1].rank != pairs[i * 2]) {
+			peers[length].rank = pairs[i * 2];
+			peers[length].length = 0;
+			length++;
+		}
+		peers[length - 1].length++;
+	}
+
+	int i = 0;
+	for (int p = 0; p < length; p++) {
+		peers[p].neurons = malloc(sizeof(int) * peers[p].length);
+		for (int position = 0; position < peers[p].length; position++, i++) {
+			peers[p].neurons[position] = pairs[i * 2 + 1];
+		}
+
+		peers[p].capacity = peers[p].length * lanes * 2 + 2;
+		for (int parity = 0; parity < 2; parity++) {
+			peers[p].buffers[parity] = malloc(sizeof(int) * peers[p].capacity);
+			peers[p].requests[parity] = MPI_REQUEST_NULL;
+		}
+		peers[p].filled = 0;
+	}
+
+	*peerLength = length;
+	return peers;
+}
+
+static void metisFreePeers(metisHaloPeer* peers, int length) {
+	for (int p = 0; p < length; p++) {
+		free(peers[p].neurons);
+		free(peers[p].buffers[0]);
+		free(peers[p].buffers[1]);
+	}
+	free(peers);
+}
+
+// A neuron with more inputs than --vertex-cut has them split into this many edge ranges,
+// each calculated by another worker. Every worker works this out on its own
+int metisCutSegments(const metisWorker* worker, int neuron) {
+	const metisModel* model = worker->model;
+	int degree = model->connectionOffsets[neuron + 1] - model->connectionOffsets[neuron];
+	int workers = worker->numberOfNodes - 1;
+	int cut = worker->options->cutDegree;
+
+	if (cut <= 0 || degree <= cut || workers < 2) {
+		return 1;
+	}
+
+	int segments = (degree + cut - 1) / cut;
+	return segments < workers ? segments : workers;
+}
+
+// Edge range of a segment of a split neuron and the worker calculating it. The owner takes the
+// first segment and the workers after it the others
+int metisCutSegment(const metisWorker* worker, int neuron, int segment, int* first, int* last) {
+	const metisModel* model = worker->model;
+	int degree = model->connectionOffsets[neuron + 1] - model->connectionOffsets[neuron];
+	int segments = metisCutSegments(worker, neuron);
+
+	*first = (int)((long long)segment * degree / segments);
+	*last = (int)((long long)(segment + 1) * degree / segments);
+	return 1 + (worker->ownerId[neuron] - 1 + segment) % (worker->numberOfNodes - 1);
+}
+
+// The worker calculating the product of an input of a neuron
+static int metisInputWorker(const metisWorker* worker, int neuron, int input) {
+	const metisModel* model = worker->model;
+	int degree = model->connectionOffsets[neuron + 1] - model->connectionOffsets[neuron];
+	int segments = metisCutSegments(worker, neuron);
+
+	if (segments == 1) {
+		return worker->ownerId[neuron];
+	}
+
+	int segment = (int)(((long long)(input + 1) * segments - 1) / degree);
+	return 1 + (worker->ownerId[neuron] - 1 + segment) % (worker->numberOfNodes - 1);
+}
+
+// Work out the split hubs I own and the edge ranges I calculate
+static void metisPlanCut(metisHalo* halo) {
+	metisWorker* worker = halo->worker;
+	metisModel* model = worker->model;
+	int lanes = worker->lanes;
+
+	halo->cutHubs = malloc(sizeof(int) * (worker->numberOfOwnedNeurons + 1));
+	halo->cutProductOffsets = malloc(sizeof(int) * (worker->numberOfOwnedNeurons + 1));
+	halo->cutHubLength = 0;
+	halo->cutProductOffsets[0] = 0;
+	for (int k = 0; k < worker->numberOfOwnedNeurons; k++) {
+		int neuron = worker->nodes[k];
+		if (metisCutSegments(worker, neuron) > 1) {
+			halo->cutHubs[halo->cutHubLength] = k;
+			halo->cutProductOffsets[halo->cutHubLength + 1] = halo->cutProductOffsets[halo->cutHubLength] +
+				model->connectionOffsets[neuron + 1] - model->connectionOffsets[neuron];
+			halo->cutHubLength++;
+		}
+	}
+	halo->cutProducts = malloc(sizeof(double) * ((size_t)halo->cutProductOffsets[halo->cutHubLength] * lanes + 1));
+
+	// A worker calculates at most one segment of a hub
+	halo->parts = malloc(sizeof(metisCutPart) * (model->neuronLength + 1));
+	halo->partLength = 0;
+	halo->cutSources = malloc(sizeof(int) * 4 * ((size_t)halo->cutHubLength * (worker->numberOfNodes - 1) + 1));
+	halo->cutSourceLength = 0;
+	int hub = 0;
+	for (int neuron = 0; neuron < model->neuronLength; neuron++) {
+		int segments = metisCutSegments(worker, neuron);
+		bool mine = worker->ownerId[neuron] == worker->id;
+		for (int segment = 0; segment < segments && segments > 1; segment++) {
+			int first;
+			int last;
+			int computer = metisCutSegment(worker, neuron, segment, &first, &last);
+
+			if (computer == worker->id) {
+				metisCutPart* part = &halo->parts[halo->partLength++];
+				part->neuron = neuron;
+				part->first = first;
+				part->last = last;
+				part->owner = worker->ownerId[neuron];
+				part->products = mine ? &halo->cutProducts[((size_t)halo->cutProductOffsets[hub] + first) * lanes] :
+					malloc(sizeof(double) * ((size_t)(last - first) * lanes + 1));
+				part->request = MPI_REQUEST_NULL;
+			}
+			else if (mine) {
+				int* source = &halo->cutSources[halo->cutSourceLength * 4];
+				source[0] = hub;
+				source[1] = first;
+				source[2] = last;
+				source[3] = computer;
+				halo->cutSourceLength++;
+			}
+		}
+		if (mine && segments > 1) {
+			hub++;
+		}
+	}
+	halo->cutRequests = malloc(sizeof(MPI_Request) * (halo->cutSourceLength + 1));
+	for (int r = 0; r < halo->cutSourceLength; r++) {
+		halo->cutRequests[r] = MPI_REQUEST_NULL;
+	}
+	halo->cutReadyTime = -1;
+}
+
+// Neurons with more outputs than --vertex-cut are replicated. Their values are gathered by every
+// worker each time step, instead of going to each one that needs them in its own halo
+static void metisPlanReplicas(metisHalo* halo) {
+	metisWorker* worker = halo->worker;
+	metisModel* model = worker->model;
+	int workers = worker->numberOfNodes - 1;
+	int cut = worker->options->cutDegree;
+
+	halo->replicated = calloc(model->neuronLength + 1, sizeof(bool));
+	halo->replicaCounts = calloc(workers + 1, sizeof(int));
+	halo->replicaDisplacements = calloc(workers + 1, sizeof(int));
+	halo->replicaLength = 0;
+	halo->replicaRequest = MPI_REQUEST_NULL;
+	if (cut > 0 && workers >= 2) {
+		int* outputs = calloc(model->neuronLength + 1, sizeof(int));
+		for (int connection = 0; connection < model->connectionLength; connection++) {
+			outputs[model->connectionSources[connection]]++;
+		}
+		for (int neuron = 0; neuron < model->neuronLength; neuron++) {
+			if (outputs[neuron] > cut) {
+				halo->replicated[neuron] = true;
+				halo->replicaCounts[worker->ownerId[neuron] - 1] += worker->lanes;
+				halo->replicaLength++;
+			}
+		}
+		free(outputs);
+	}
+
+	for (int w = 1; w < workers; w++) {
+		halo->replicaDisplacements[w] = halo->replicaDisplacements[w - 1] + halo->replicaCounts[w - 1];
+	}
+
+	halo->replicas = malloc(sizeof(int) * (halo->replicaLength + 1));
+	int* next = malloc(sizeof(int) * (workers + 1));
+	for (int w = 0; w < workers; w++) {
+		next[w] = halo->replicaDisplacements[w] / worker->lanes;
+	}
+	for (int neuron = 0; neuron < model->neuronLength; neuron++) {
+		if (halo->replicated[neuron]) {
+			halo->replicas[next[worker->ownerId[neuron] - 1]++] = neuron;
+		}
+	}
+	free(next);
+
+	halo->replicaSend = malloc(sizeof(int) * (halo->replicaCounts[worker->id - 1] + 1));
+	halo->replicaValues = malloc(sizeof(int) * ((size_t)halo->replicaLength * worker->lanes + 1));
+}
+
+// Work out once which values have to cross hosts. Both sides of an exchange list the
+// neurons in id order, so a message only has to carry the values
+static void metisPlanHalo(metisHalo* halo) {
+	metisWorker* worker = halo->worker;
+	metisModel* model = worker->model;
+	int pairLength = 0;
+	int* pairs = malloc(sizeof(int) * 2 * (model->connectionLength + 1));
+
+	// Inputs owned by other workers of my neurons and of the split hub ranges I calculate.
+	// Replicated inputs are gathered by every worker
+	bool* needed = calloc(model->neuronLength + 1, sizeof(bool));
+	for (int neuron = 0; neuron < model->neuronLength; neuron++) {
+		if (worker->ownerId[neuron] != worker->id && metisCutSegments(worker, neuron) == 1) {
+			continue;
+		}
+
+		for (int connection = model->connectionOffsets[neuron]; connection < model->connectionOffsets[neuron + 1]; connection++) {
+			int source = model->connectionSources[connection];
+			if (worker->ownerId[source] != worker->id && !halo->replicated[source] &&
+				metisInputWorker(worker, neuron, connection - model->connectionOffsets[neuron]) == worker->id) {
+				needed[source] = true;
+			}
+		}
+	}
+
+	halo->localGhosts = malloc(sizeof(int) * (model->neuronLength + 1));
+	halo->localGhostLength = 0;
+	for (int neuron = 0; neuron < model->neuronLength; neuron++) {
+		if (!needed[neuron]) {
+			continue;
+		}
+
+		int owner = worker->ownerId[neuron];
+		if (worker->peerActivity[owner] != NULL) {
+			halo->localGhosts[halo->localGhostLength++] = neuron;
+		}
+		else {
+			pairs[pairLength * 2] = owner;
+			pairs[pairLength * 2 + 1] = neuron;
+			pairLength++;
+		}
+	}
+	free(needed);
+
+	qsort(pairs, pairLength, sizeof(int) * 2, metisComparePairs);
+	halo->producers = metisNewPeers(pairs, pairLength, worker->lanes, &halo->producerLength);
+
+	// My neurons that are inputs calculated by workers on other hosts
+	pairLength = 0;
+	for (int neuron = 0; neuron < model->neuronLength; neuron++) {
+		for (int connection = model->connectionOffsets[neuron]; connection < model->connectionOffsets[neuron + 1]; connection++) {
+			int source = model->connectionSources[connection];
+			if (worker->ownerId[source] != worker->id || halo->replicated[source]) {
+				continue;
+			}
+
+			int computer = metisInputWorker(worker, neuron, connection - model->connectionOffsets[neuron]);
+			if (computer != worker->id && worker->peerActivity[computer] == NULL) {
+				pairs[pairLength * 2] = computer;
+				pairs[pairLength * 2 + 1] = source;
+				pairLength++;
+			}
+		}
+	}
+
+	qsort(pairs, pairLength, sizeof(int) * 2, metisComparePairs);
+	int unique = 0;
+	for (int i = 0; i < pairLength; i++) {
+		if (unique == 0 || metisComparePairs(&pairs[i * 2], &pairs[(unique - 1) * 2]) != 0) {
+			pairs[unique * 2] = pairs[i * 2];
+			pairs[unique * 2 + 1] = pairs[i * 2 + 1];
+			unique++;
+		}
+	}
+	halo->consumers = metisNewPeers(pairs, unique, worker->lanes, &halo->consumerLength);
+	free(pairs);
+
+	// Index the consumers by owned neuron so a finished value goes straight into its buffers
+	halo->sendOffsets = calloc(worker->numberOfOwnedNeurons + 1, sizeof(int));
+	for (int c = 0; c < halo->consumerLength; c++) {
+		for (int position = 0; position < halo->consumers[c].length; position++) {
+			halo->sendOffsets[worker->neuronSlot[halo->consumers[c].neurons[position]] + 1]++;
+		}
+	}
+	for (int k = 0; k < worker->numberOfOwnedNeurons; k++) {
+		halo->sendOffsets[k + 1] += halo->sendOffsets[k];
+	}
+
+	int* next = malloc(sizeof(int) * (worker->numberOfOwnedNeurons + 1));
+	memcpy(next, halo->sendOffsets, sizeof(int) * (worker->numberOfOwnedNeurons + 1));
+	halo->sendTargets = malloc(sizeof(int) * 2 * (halo->sendOffsets[worker->numberOfOwnedNeurons] + 1));
+	for (int c = 0; c < halo->consumerLength; c++) {
+		for (int position = 0; position < halo->consumers[c].length; position++) {
+			int k = worker->neuronSlot[halo->consumers[c].neurons[position]];
+			halo->sendTargets[next[k] * 2] = c;
+			halo->sendTargets[next[k] * 2 + 1] = position;
+			next[k]++;
+		}
+	}
+	free(next);
+}
+
+// Index the owned neurons by their inputs, so a change can be followed to the neurons it affects
+static void metisPlanSuccessors(metisHalo* halo) {
+	metisWorker* worker = halo->worker;
+	metisModel* model = worker->model;
+
+	halo->successorOffsets = calloc(model->neuronLength + 1, sizeof(int));
+	halo->productOffsets = malloc(sizeof(int) * (worker->numberOfOwnedNeurons + 1));
+	halo->productOffsets[0] = 0;
+	for (int k = 0; k < worker->numberOfOwnedNeurons; k++) {
+		int neuron = worker->nodes[k];
+		for (int connection = model->connectionOffsets[neuron]; connection < model->connectionOffsets[neuron + 1]; connection++) {
+			halo->successorOffsets[model->connectionSources[connection] + 1]++;
+		}
+		halo->productOffsets[k + 1] = halo->productOffsets[k] + model->connectionOffsets[neuron + 1] - model->connectionOffsets[neuron];
+	}
+	for (int neuron = 0; neuron < model->neuronLength; neuron++) {
+		halo->successorOffsets[neuron + 1] += halo->successorOffsets[neuron];
+	}
+
+	int* next = malloc(sizeof(int) * (model->neuronLength + 1));
+	memcpy(next, halo->successorOffsets, sizeof(int) * (model->neuronLength + 1));
+	halo->successors = malloc(sizeof(int) * (halo->successorOffsets[model->neuronLength] + 1));
+	halo->successorConnections = malloc(sizeof(int) * (halo->successorOffsets[model->neuronLength] + 1));
+	for (int k = 0; k < worker->numberOfOwnedNeurons; k++) {
+		int neuron = worker->nodes[k];
+		for (int connection = model->connectionOffsets[neuron]; connection < model->connectionOffsets[neuron + 1]; connection++) {
+			int i = next[model->connectionSources[connection]]++;
+			halo->successors[i] = k;
+			halo->successorConnections[i] = connection;
+		}
+	}
+	free(next);
+
+	// Nothing has been gathered yet, so the first push gathers the products of every neuron it visits
+	halo->products = malloc(sizeof(double) * (halo->productOffsets[worker->numberOfOwnedNeurons] + 1));
+	halo->fresh = calloc(worker->numberOfOwnedNeurons + 1, sizeof(bool));
+	halo->changedInputs = malloc(sizeof(int) * (model->neuronLength + 1));
+	halo->changedInputLength = 0;
+	halo->scatterEdges = 0;
+	halo->gatherEdges = 0;
+	halo->staleEdges = 0;
+	halo->pushSteps = 0;
+
+	halo->visitStamp = malloc(sizeof(int) * (worker->numberOfOwnedNeurons + 1));
+	halo->visit = malloc(sizeof(int) * (worker->numberOfOwnedNeurons + 1));
+	halo->changes = malloc(sizeof(int) * 2 * (worker->numberOfOwnedNeurons + 1));
+	for (int k = 0; k < worker->numberOfOwnedNeurons; k++) {
+		halo->visitStamp[k] = -1;
+	}
+	halo->visitLength = 0;
+	halo->changeLength = 0;
+	halo->visited = 0;
+}
+
+// Put an owned neuron on the visit list of the current time step, once
+static void metisVisit(metisHalo* halo, int k) {
+	if (halo->visitStamp[k] != halo->worker->time) {
+		int inputs = halo->productOffsets[k + 1] - halo->productOffsets[k];
+
+		halo->visitStamp[k] = halo->worker->time;
+		halo->visit[halo->visitLength++] = k;
+		halo->gatherEdges += inputs;
+		if (!halo->fresh[k]) {
+			halo->staleEdges += inputs;
+		}
+	}
+}
+
+// A neuron changed, so every owned neuron it is an input of has to be recalculated
+static void metisVisitSuccessors(metisHalo* halo, int neuron) {
+	halo->changedInputs[halo->changedInputLength++] = neuron;
+	halo->scatterEdges += halo->successorOffsets[neuron + 1] - halo->successorOffsets[neuron];
+	for (int i = halo->successorOffsets[neuron]; i < halo->successorOffsets[neuron + 1]; i++) {
+		metisVisit(halo, halo->successors[i]);
+	}
+}
+
+// Mark which of my neurons a stimulus sets in the given time step
+static void metisMarkStimulus(metisHalo* halo, int time) {
+	metisWorker* worker = halo->worker;
+	metisModel* model = worker->model;
+
+	// Keep the marks of the current step, a neuron leaving a stimulus changes as well
+	bool* current = halo->stimulatedNow;
+	halo->stimulatedNow = halo->stimulated;
+	halo->stimulated = current;
+	memset(halo->stimulated, 0, sizeof(bool) * worker->numberOfOwnedNeurons * worker->lanes);
+	for (int io = 0; io < model->ioLength; io++) {
+		const metisModelIO* device = &model->io[io];
+		for (int lane = 0; lane < worker->lanes; lane++) {
+			if (!metisStimulusActive(worker, io, lane, time)) {
+				continue;
+			}
+
+			for (int j = 0; j < device->connectionsLength; j++) {
+				int neuron = model->ioConnections[device->connectionOffset + j];
+				if (worker->ownerId[neuron] == worker->id) {
+					halo->stimulated[worker->neuronSlot[neuron] * worker->lanes + lane] = true;
+				}
+			}
+		}
+	}
+}
+
+// Let the workers on my host know my slice holds the current time step
+static void metisPublishTime(metisHalo* halo) {
+	metisWorker* worker = halo->worker;
+
+	MPI_Win_sync(worker->activityWindow);
+	worker->publishedActivity[0] = worker->time;
+	MPI_Win_sync(worker->activityWindow);
+}
+
+// Publish the state of my neurons for the current time step to the workers on my host
+static void metisPublish(metisHalo* halo) {
+	metisWorker* worker = halo->worker;
+
+	for (int k = 0; k < worker->numberOfOwnedNeurons; k++) {
+		for (int lane = 0; lane < worker->lanes; lane++) {
+			worker->publishedActivity[k * worker->lanes + lane + 1] = worker->activityLevel[worker->nodes[k] * worker->lanes + lane];
+		}
+	}
+	metisPublishTime(halo);
+}
+
+static void metisPostReceives(metisHalo* halo, int time) {
+	for (int p = 0; p < halo->producerLength; p++) {
+		metisHaloPeer* producer = &halo->producers[p];
+		MPI_Irecv(producer->buffers[time % 2], producer->capacity, MPI_INT, producer->rank, METIS_HALO, MPI_COMM_WORLD, &producer->requests[time % 2]);
+	}
+}
+
+// Set an input owned by another worker, with an active set its successors are visited if it changed
+static void metisSetInput(metisHalo* halo, int neuron, int value) {
+	int* activityLevel = halo->worker->activityLevel;
+
+	if (halo->active && activityLevel[neuron] != value) {
+		metisVisitSuccessors(halo, neuron);
+	}
+	activityLevel[neuron] = value;
+}
+
+// Start gathering the replicated values of a time step on every worker
+static void metisShareReplicas(metisHalo* halo, const int* values) {
+	metisWorker* worker = halo->worker;
+	int lanes = worker->lanes;
+	int me = worker->id - 1;
+
+	if (halo->replicaLength == 0) {
+		return;
+	}
+
+	const int* mine = &halo->replicas[halo->replicaDisplacements[me] / lanes];
+	for (int i = 0; i < halo->replicaCounts[me] / lanes; i++) {
+		memcpy(&halo->replicaSend[i * lanes], &values[mine[i] * lanes], sizeof(int) * lanes);
+	}
+	MPI_Iallgatherv(halo->replicaSend, halo->replicaCounts[me], MPI_INT, halo->replicaValues, halo->replicaCounts,
+		halo->replicaDisplacements, MPI_INT, worker->workerComm, &halo->replicaRequest);
+}
+
+// Post the receives of the products of my split hubs calculated by other workers
+static void metisPostCutReceives(metisHalo* halo) {
+	int lanes = halo->worker->lanes;
+
+	for (int r = 0; r < halo->cutSourceLength; r++) {
+		const int* source = &halo->cutSources[r * 4];
+		double* products = &halo->cutProducts[((size_t)halo->cutProductOffsets[source[0]] + source[1]) * lanes];
+		MPI_Irecv(products, (source[2] - source[1]) * lanes, MPI_DOUBLE, source[3], METIS_CUT, MPI_COMM_WORLD, &halo->cutRequests[r]);
+	}
+}
+
+// Send the products of the split hub ranges I calculate for other workers
+static void metisSendCutParts(metisHalo* halo) {
+	int lanes = halo->worker->lanes;
+
+	for (int p = 0; p < halo->partLength; p++) {
+		metisCutPart* part = &halo->parts[p];
+		if (part->owner != halo->worker->id) {
+			MPI_Isend(part->products, (part->last - part->first) * lanes, MPI_DOUBLE, part->owner, METIS_CUT, MPI_COMM_WORLD, &part->request);
+		}
+	}
+}
+
+// Wait until every input of the current time step has arrived and copy it into place
+static void metisCollectInputs(metisHalo* halo) {
+	metisWorker* worker = halo->worker;
+	int parity = worker->time % 2;
+
+	if (halo->replicaLength > 0) {
+		MPI_Wait(&halo->replicaRequest, MPI_STATUS_IGNORE);
+		for (int i = 0; i < halo->replicaLength; i++) {
+			int neuron = halo->replicas[i];
+			if (worker->ownerId[neuron] != worker->id) {
+				memcpy(&worker->activityLevel[neuron * worker->lanes], &halo->replicaValues[i * worker->lanes], sizeof(int) * worker->lanes);
+			}
+		}
+	}
+
+	for (int p = 0; p < halo->producerLength; p++) {
+		metisHaloPeer* producer = &halo->producers[p];
+		MPI_Wait(&producer->requests[parity], MPI_STATUS_IGNORE);
+		int* buffer = producer->buffers[parity];
+		if (buffer[0] != worker->time) {
+			fprintf(stderr, "WORKER %d> Halo from worker %d is for time step %d instead of %d\n", worker->id, producer->rank, buffer[0], worker->time);
+		}
+
+		if (halo->active) {
+			for (int i = 0; i < buffer[1]; i++) {
+				metisSetInput(halo, producer->neurons[buffer[i * 2 + 2]], buffer[i * 2 + 3]);
+			}
+		}
+		else {
+			for (int i = 0; i < producer->length; i++) {
+				memcpy(&worker->activityLevel[producer->neurons[i] * worker->lanes], &buffer[i * worker->lanes + 1], sizeof(int) * worker->lanes);
+			}
+		}
+	}
+
+	// Workers on my host can not move on before I am done, so once they have
+	// published this time step their slices stay valid for the rest of it
+	for (int i = 0; i < halo->localGhostLength; i++) {
+		int neuron = halo->localGhosts[i];
+		int owner = worker->ownerId[neuron];
+		while (__atomic_load_n(&worker->peerActivity[owner][0], __ATOMIC_RELAXED) != worker->time) {
+			sched_yield();
+			MPI_Win_sync(worker->activityWindow);
+		}
+	}
+	MPI_Win_sync(worker->activityWindow);
+	for (int i = 0; i < halo->localGhostLength; i++) {
+		int neuron = halo->localGhosts[i];
+		const int* slice = worker->peerActivity[worker->ownerId[neuron]];
+		if (halo->active) {
+			metisSetInput(halo, neuron, slice[worker->neuronSlot[neuron] + 1]);
+		}
+		else {
+			memcpy(&worker->activityLevel[neuron * worker->lanes], &slice[worker->neuronSlot[neuron] * worker->lanes + 1], sizeof(int) * worker->lanes);
+		}
+	}
+}
+
+// Send the buffer of a time step. It holds every value, or only the changes with an active set
+static void metisSendHalo(metisHalo* halo, metisHaloPeer* consumer, int time) {
+	int* buffer = consumer->buffers[time % 2];
+	int length = consumer->length * halo->worker->lanes + 1;
+
+	buffer[0] = time;
+	if (halo->active) {
+		buffer[1] = consumer->filled;
+		length = consumer->filled * 2 + 2;
+	}
+	MPI_Isend(buffer, length, MPI_INT, consumer->rank, METIS_HALO, MPI_COMM_WORLD, &consumer->requests[time % 2]);
+	consumer->filled = 0;
+}
+
+// Pack a value of the next time step for every worker that needs it, the key is the owned neuron
+// times the number of lanes plus the lane. An active set has a single lane
+static void metisPackValue(metisHalo* halo, int key, int value, int time, bool send) {
+	int lanes = halo->worker->lanes;
+	int k = key / lanes;
+
+	for (int target = halo->sendOffsets[k]; target < halo->sendOffsets[k + 1]; target++) {
+		metisHaloPeer* consumer = &halo->consumers[halo->sendTargets[target * 2]];
+		int position = halo->sendTargets[target * 2 + 1];
+		int* buffer = consumer->buffers[time % 2];
+
+		if (halo->active) {
+			buffer[consumer->filled * 2 + 2] = position;
+			buffer[consumer->filled * 2 + 3] = value;
+			consumer->filled++;
+		}
+		else {
+			buffer[position * lanes + key % lanes + 1] = value;
+			if (++consumer->filled == consumer->length * lanes && send) {
+				metisSendHalo(halo, consumer, time);
+			}
+		}
+	}
+}
+
+static void metisPush(metisHalo* halo, int thread, int k, int value) {
+	while (!metisRingPush(&halo->rings[thread], k, value)) {
+		sched_yield();
+	}
+}
+
+// Hand a finished value of the next time step to the communication thread
+static void metisHandOff(metisHalo* halo, int thread, int k, int lane, int value) {
+	if (halo->sendOffsets[k] != halo->sendOffsets[k + 1]) {
+		metisPush(halo, thread, k * halo->worker->lanes + lane, value);
+	}
+}
+
+// Calculate the value of my neurons for the next time step, stimulus included
+static void metisHaloUpdate(const metisBlock* block, int index, int thread, void* arg) {
+	metisHalo* halo = arg;
+	metisWorker* worker = halo->worker;
+
+	int lanes = worker->lanes;
+
+	if (block->hub != -1) {
+		// A stimulated hub does not need its products, unless another lane of it does
+		if (lanes > 1 || !halo->stimulated[block->first]) {
+			metisHubProducts(worker, block);
+		}
+		return;
+	}
+
+	// A single lane is laid out in the format of the worker
+	if (lanes == 1) {
+		metisMatrixBlock(worker->matrix, worker->model, worker->nodes, block, index, worker->activityLevel, worker->nextValue);
+		for (int k = block->first; k < block->last; k++) {
+			int value = halo->stimulated[k] ? 10 : worker->nextValue[worker->nodes[k]];
+
+			worker->nextValue[worker->nodes[k]] = value;
+			metisHandOff(halo, thread, k, 0, value);
+		}
+		return;
+	}
+
+	int values[METIS_KERNEL_BATCH * METIS_MAX_LANES];
+	for (int k = block->first; k < block->last; k += METIS_KERNEL_BATCH) {
+		int length = block->last - k < METIS_KERNEL_BATCH ? block->last - k : METIS_KERNEL_BATCH;
+
+		metisCalculateNeuronLanes(worker->model, worker->activityLevel, lanes, &worker->nodes[k], length, values);
+		for (int i = 0; i < length; i++) {
+			for (int lane = 0; lane < lanes; lane++) {
+				int value = halo->stimulated[(k + i) * lanes + lane] ? 10 : values[i * lanes + lane];
+
+				worker->nextValue[worker->nodes[k + i] * lanes + lane] = value;
+				metisHandOff(halo, thread, k + i, lane, value);
+			}
+		}
+	}
+}
+
+// Calculate my share of the split hub ranges, then add up the split hubs I own once the
+// ranges of the other workers are in. The ranges for other workers are handed to the
+// communication thread first, so no worker waits on one that waits on it
+static void metisCutUpdate(metisHalo* halo, int thread, int time) {
+	metisWorker* worker = halo->worker;
+	metisModel* model = worker->model;
+	int lanes = worker->lanes;
+	int first;
+	int last;
+
+	metisPoolRange(halo->partLength, thread, halo->computeThreads, &first, &last);
+	for (int p = first; p < last; p++) {
+		const metisCutPart* part = &halo->parts[p];
+		int connFirst = model->connectionOffsets[part->neuron];
+		for (int input = part->first; input < part->last; input++) {
+			int connection = connFirst + input;
+			const int* source = &worker->activityLevel[model->connectionSources[connection] * lanes];
+			for (int lane = 0; lane < lanes; lane++) {
+				part->products[(input - part->first) * lanes + lane] = model->connectionSensitivities[connection] * source[lane];
+			}
+		}
+	}
+
+	// A key of -2 tells the communication thread the ranges can be sent
+	if (pthread_barrier_wait(&halo->barrier) == PTHREAD_BARRIER_SERIAL_THREAD) {
+		metisPush(halo, thread, -2, time);
+	}
+
+	pthread_mutex_lock(&halo->lock);
+	while (halo->cutReadyTime < time) {
+		pthread_cond_wait(&halo->ready, &halo->lock);
+	}
+	pthread_mutex_unlock(&halo->lock);
+
+	metisPoolRange(halo->cutHubLength, thread, halo->computeThreads, &first, &last);
+	for (int hub = first; hub < last; hub++) {
+		int k = halo->cutHubs[hub];
+		for (int lane = 0; lane < lanes; lane++) {
+			double total = 0;
+			for (int input = halo->cutProductOffsets[hub]; input < halo->cutProductOffsets[hub + 1]; input++) {
+				total += halo->cutProducts[(size_t)input * lanes + lane];
+			}
+
+			int value = halo->stimulated[k * lanes + lane] ? 10 : total <= 10 ? (int)total : 10;
+			worker->nextValue[worker->nodes[k] * lanes + lane] = value;
+			metisHandOff(halo, thread, k, lane, value);
+		}
+	}
+}
+
+// Compute threads only touch memory, they wait for the communication thread to
+// bring in the inputs of a time step and hand every finished boundary value back to it
+static void metisCompute(metisHalo* halo, int thread) {
+	metisWorker* worker = halo->worker;
+	metisScheduler* scheduler = worker->scheduler;
+
+	for (int time = 0; time < worker->model->simulationLength; time++) {
+		pthread_mutex_lock(&halo->lock);
+		while (halo->readyTime < time) {
+			pthread_cond_wait(&halo->ready, &halo->lock);
+		}
+		pthread_mutex_unlock(&halo->lock);
+
+		// The blocked format streams all of its inputs into the bins of the blocks first
+		if (worker->matrix->format == METIS_FORMAT_BLOCKED) {
+			metisMatrixScatter(worker->matrix, worker->activityLevel, thread, halo->computeThreads);
+			pthread_barrier_wait(&halo->barrier);
+		}
+
+		metisSchedulerWork(scheduler, thread, metisHaloUpdate, halo);
+
+		// Every edge range has run once all threads are here. Refilling the deques is safe
+		// as well, nobody takes a block again before this step has been handed off
+		if (pthread_barrier_wait(&halo->barrier) == PTHREAD_BARRIER_SERIAL_THREAD) {
+			metisSchedulerReset(scheduler);
+		}
+
+		int first;
+		int last;
+		metisPoolRange(scheduler->hubLength, thread, halo->computeThreads, &first, &last);
+		for (int hub = first; hub < last; hub++) {
+			int k = scheduler->hubs[hub];
+			for (int lane = 0; lane < worker->lanes; lane++) {
+				int value = halo->stimulated[k * worker->lanes + lane] ? 10 : metisReduceHub(worker, hub, lane);
+
+				worker->nextValue[worker->nodes[k] * worker->lanes + lane] = value;
+				metisHandOff(halo, thread, k, lane, value);
+			}
+		}
+
+		if (worker->options->cutDegree > 0) {
+			metisCutUpdate(halo, thread, time);
+		}
+
+		// A key of -1 tells the communication thread this thread is done with the step
+		metisPush(halo, thread, -1, time);
+	}
+}
+
+// Pull: gather the inputs of my part of the visit list
+static void metisPullActive(metisHalo* halo, int thread) {
+	metisWorker* worker = halo->worker;
+	int batch[METIS_KERNEL_BATCH];
+	int values[METIS_KERNEL_BATCH];
+	int first;
+	int last;
+
+	metisPoolRange(halo->visitLength, thread, halo->computeThreads, &first, &last);
+	for (int i = first; i < last; i += METIS_KERNEL_BATCH) {
+		int length = last - i < METIS_KERNEL_BATCH ? last - i : METIS_KERNEL_BATCH;
+		for (int b = 0; b < length; b++) {
+			batch[b] = worker->nodes[halo->visit[i + b]];
+		}
+
+		metisCalculateNeurons(worker->model, worker->activityLevel, batch, length, values);
+		for (int b = 0; b < length; b++) {
+			int k = halo->visit[i + b];
+			int value = halo->stimulated[k] ? 10 : values[b];
+			if (value != worker->activityLevel[batch[b]]) {
+				metisPush(halo, thread, k, value);
+			}
+		}
+	}
+}
+
+// Keep the weighted inputs of every neuron as products and add them up in input order, with
+// the same result as the kernels. A push scatters the weighted value of my part of the changed
+// inputs into the products of the neurons they feed. Every edge has its own product, so threads
+// never write the same one. A pull gathers all products of my part of the visit list instead
+static void metisProductActive(metisHalo* halo, int thread) {
+	metisWorker* worker = halo->worker;
+	metisModel* model = worker->model;
+	int first;
+	int last;
+
+	if (halo->push) {
+		metisPoolRange(halo->changedInputLength, thread, halo->computeThreads, &first, &last);
+		for (int i = first; i < last; i++) {
+			int neuron = halo->changedInputs[i];
+			int level = worker->activityLevel[neuron];
+			for (int successor = halo->successorOffsets[neuron]; successor < halo->successorOffsets[neuron + 1]; successor++) {
+				int k = halo->successors[successor];
+				int connection = halo->successorConnections[successor];
+				int product = halo->productOffsets[k] + connection - model->connectionOffsets[worker->nodes[k]];
+				halo->products[product] = model->connectionSensitivities[connection] * level;
+			}
+		}
+
+		// Every product is in place once all threads are here
+		pthread_barrier_wait(&halo->barrier);
+	}
+
+	metisPoolRange(halo->visitLength, thread, halo->computeThreads, &first, &last);
+	for (int i = first; i < last; i++) {
+		int k = halo->visit[i];
+		int neuron = worker->nodes[k];
+		double* products = &halo->products[halo->productOffsets[k]];
+
+		if (!halo->push || !halo->fresh[k]) {
+			for (int connection = model->connectionOffsets[neuron]; connection < model->connectionOffsets[neuron + 1]; connection++) {
+				products[connection - model->connectionOffsets[neuron]] = model->connectionSensitivities[connection] * worker->activityLevel[model->connectionSources[connection]];
+			}
+			halo->fresh[k] = true;
+		}
+
+		double total = 0;
+		for (int product = 0; product < halo->productOffsets[k + 1] - halo->productOffsets[k]; product++) {
+			total += products[product];
+		}
+
+		int value = halo->stimulated[k] ? 10 : total <= 10 ? (int)total : 10;
+		if (value != worker->activityLevel[neuron]) {
+			metisPush(halo, thread, k, value);
+		}
+	}
+}
+
+// With an active set the threads split the visit list and only hand over values that changed
+static void metisComputeActive(metisHalo* halo, int thread) {
+	metisWorker* worker = halo->worker;
+
+	for (int time = 0; time < worker->model->simulationLength; time++) {
+		pthread_mutex_lock(&halo->lock);
+		while (halo->readyTime < time) {
+			pthread_cond_wait(&halo->ready, &halo->lock);
+		}
+		pthread_mutex_unlock(&halo->lock);
+
+		// A plain pull does not need the products, and leaves them to the kernels
+		if (halo->direction == METIS_PULL) {
+			metisPullActive(halo, thread);
+		}
+		else {
+			metisProductActive(halo, thread);
+		}
+
+		metisPush(halo, thread, -1, time);
+	}
+}
+
+// The only thread of the worker that calls MPI. It posts the halo receives, sends boundary
+// values as soon as the compute threads finish them and reports finished steps to the master
+static void metisCommunicate(metisHalo* halo) {
+	metisWorker* worker = halo->worker;
+	metisModel* model = worker->model;
+
+	// Unknown neurons count as 0, so my neurons start there before the first stimulus
+	worker->time = 0;
+	metisMarkStimulus(halo, 0);
+	for (int k = 0; k < worker->numberOfOwnedNeurons; k++) {
+		for (int lane = 0; lane < worker->lanes; lane++) {
+			worker->activityLevel[worker->nodes[k] * worker->lanes + lane] = halo->stimulated[k * worker->lanes + lane] ? 10 : 0;
+		}
+	}
+	metisPublish(halo);
+	metisPostReceives(halo, 0);
+	metisShareReplicas(halo, worker->activityLevel);
+	for (int k = 0; k < worker->numberOfOwnedNeurons; k++) {
+		for (int lane = 0; lane < worker->lanes; lane++) {
+			metisPackValue(halo, k * worker->lanes + lane, worker->activityLevel[worker->nodes[k] * worker->lanes + lane], 0, true);
+		}
+	}
+	if (halo->active) {
+		for (int c = 0; c < halo->consumerLength; c++) {
+			metisSendHalo(halo, &halo->consumers[c], 0);
+		}
+
+		// Nothing has been calculated yet, so every neuron is visited in the first step
+		for (int k = 0; k < worker->numberOfOwnedNeurons; k++) {
+			metisVisit(halo, k);
+		}
+	}
+
+	while (worker->time < model->simulationLength) {
+		int next = worker->time + 1;
+		bool sendNext = next < model->simulationLength;
+
+		metisCollectInputs(halo);
+		if (sendNext) {
+			metisPostReceives(halo, next);
+		}
+
+		// The buffers of the next step were last sent two steps ago, which has to be done by now
+		for (int c = 0; c < halo->consumerLength; c++) {
+			MPI_Wait(&halo->consumers[c].requests[next % 2], MPI_STATUS_IGNORE);
+			halo->consumers[c].filled = 0;
+		}
+
+		// The split hub ranges of the last step are sent before they are calculated again
+		for (int p = 0; p < halo->partLength; p++) {
+			MPI_Wait(&halo->parts[p].request, MPI_STATUS_IGNORE);
+		}
+		metisPostCutReceives(halo);
+		bool cutReady = false;
+
+		metisMarkStimulus(halo, next);
+		if (halo->active) {
+			for (int k = 0; k < worker->numberOfOwnedNeurons; k++) {
+				if (halo->stimulated[k] || halo->stimulatedNow[k]) {
+					metisVisit(halo, k);
+				}
+			}
+			halo->visited += halo->visitLength;
+
+			halo->push = halo->direction == METIS_PUSH;
+			if (halo->direction == METIS_AUTO) {
+				halo->push = (halo->scatterEdges + halo->staleEdges) * METIS_PUSH_RATIO < halo->gatherEdges;
+			}
+			halo->pushSteps += halo->push;
+		}
+
+		pthread_mutex_lock(&halo->lock);
+		halo->readyTime = worker->time;
+		pthread_cond_broadcast(&halo->ready);
+		pthread_mutex_unlock(&halo->lock);
+
+		// Pack finished values, without an active set every buffer is sent as soon as it is full
+		int doneThreads = 0;
+		while (doneThreads < halo->computeThreads) {
+			bool idle = true;
+
+			// Let the compute threads add up my split hubs once all of their ranges are in
+			if (!cutReady) {
+				int flag;
+				MPI_Testall(halo->cutSourceLength, halo->cutRequests, &flag, MPI_STATUSES_IGNORE);
+				if (flag) {
+					pthread_mutex_lock(&halo->lock);
+					halo->cutReadyTime = worker->time;
+					pthread_cond_broadcast(&halo->ready);
+					pthread_mutex_unlock(&halo->lock);
+					cutReady = true;
+				}
+			}
+
+			for (int thread = 0; thread < halo->computeThreads; thread++) {
+				metisRingItem item;
+				while (metisRingPop(&halo->rings[thread], &item)) {
+					idle = false;
+					if (item.key == -2) {
+						metisSendCutParts(halo);
+						continue;
+					}
+					if (item.key < 0) {
+						doneThreads++;
+						continue;
+					}
+
+					metisPackValue(halo, item.key, item.value, next, sendNext);
+					if (halo->active) {
+						halo->changes[halo->changeLength * 2] = item.key;
+						halo->changes[halo->changeLength * 2 + 1] = item.value;
+						halo->changeLength++;
+					}
+				}
+			}
+
+			if (idle) {
+				sched_yield();
+			}
+		}
+
+		// The changes are only complete once every compute thread is done
+		if (halo->active && sendNext) {
+			for (int c = 0; c < halo->consumerLength; c++) {
+				metisSendHalo(halo, &halo->consumers[c], next);
+			}
+		}
+		if (sendNext) {
+			metisShareReplicas(halo, worker->nextValue);
+		}
+
+		int done = 1;
+		MPI_Send(&done, 1, MPI_INT, MASTER, METIS_TASK_DONE, MPI_COMM_WORLD);
+		if (DEBUG)
+			printf("WORKER %d> Sending DONE message\n", worker->id);
+
+		int data[1];
+		MPI_Recv(data, 1, MPI_INT, MASTER, METIS_TIME_UPDATE, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+		metisPrintState(worker);
+
+		if (halo->active) {
+			// Only the neurons that changed are written, and their successors are visited next
+			worker->time++;
+			halo->visitLength = 0;
+			halo->changedInputLength = 0;
+			halo->scatterEdges = 0;
+			halo->gatherEdges = 0;
+			halo->staleEdges = 0;
+			for (int i = 0; i < halo->changeLength; i++) {
+				int k = halo->changes[i * 2];
+				worker->activityLevel[worker->nodes[k]] = halo->changes[i * 2 + 1];
+				worker->publishedActivity[k + 1] = halo->changes[i * 2 + 1];
+				metisVisitSuccessors(halo, worker->nodes[k]);
+			}
+			halo->changeLength = 0;
+			if (worker->time < model->simulationLength) {
+				metisPublishTime(halo);
+			}
+			continue;
+		}
+
+		for (int k = 0; k < worker->numberOfOwnedNeurons; k++) {
+			int neuron = worker->nodes[k] * worker->lanes;
+			memcpy(&worker->activityLevel[neuron], &worker->nextValue[neuron], sizeof(int) * worker->lanes);
+		}
+		worker->time++;
+		if (worker->time < model->simulationLength) {
+			metisPublish(halo);
+		}
+	}
+
+	for (int c = 0; c < halo->consumerLength; c++) {
+		MPI_Waitall(2, halo->consumers[c].requests, MPI_STATUSES_IGNORE);
+	}
+	for (int p = 0; p < halo->partLength; p++) {
+		MPI_Wait(&halo->parts[p].request, MPI_STATUS_IGNORE);
+	}
+}
+
+static void metisHaloThread(int thread, int threadLength, void* arg) {
+	(void)threadLength;
+	if (thread == 0) {
+		metisCommunicate(arg);
+	}
+	else {
+		metisHalo* halo = arg;
+		if (halo->active) {
+			metisComputeActive(halo, thread - 1);
+		}
+		else {
+			metisCompute(halo, thread - 1);
+		}
+	}
+}
+
+// Run the simulation with thread 0 of the pool doing all of the communication
+void runHaloWorker(metisWorker* worker) {
+	metisHalo haloState;
+	metisHalo* halo = &haloState;
+
+	halo->worker = worker;
+	halo->computeThreads = worker->pool->threadLength - 1;
+	halo->readyTime = -1;
+	halo->active = worker->options->activeSet;
+	halo->direction = worker->options->direction;
+	halo->stimulated = calloc(worker->numberOfOwnedNeurons * worker->lanes + 1, sizeof(bool));
+	halo->stimulatedNow = calloc(worker->numberOfOwnedNeurons * worker->lanes + 1, sizeof(bool));
+	metisPlanReplicas(halo);
+	metisPlanCut(halo);
+	metisPlanHalo(halo);
+	if (halo->active) {
+		metisPlanSuccessors(halo);
+	}
+
+	// A ring can hold every value of a step, so compute threads never wait on a slow sender
+	halo->rings = malloc(sizeof(metisRing) * halo->computeThreads);
+	for (int thread = 0; thread < halo->computeThreads; thread++) {
+		metisInitRing(&halo->rings[thread], worker->numberOfOwnedNeurons * worker->lanes + 2);
+	}
+	pthread_mutex_init(&halo->lock, NULL);
+	pthread_cond_init(&halo->ready, NULL);
+	pthread_barrier_init(&halo->barrier, NULL, halo->computeThreads);
+	metisSchedulerReset(worker->scheduler);
+
+	if (DEBUG)
+		printf("WORKER %d> Receiving from %d workers, sending to %d workers, %d inputs through shared memory\n",
+			worker->id, halo->producerLength, halo->consumerLength, halo->localGhostLength);
+
+	metisPoolRun(worker->pool, metisHaloThread, halo);
+
+	if (worker->options->report) {
+		int received = 0;
+		int sent = 0;
+		for (int p = 0; p < halo->producerLength; p++) {
+			received += halo->producers[p].length;
+		}
+		for (int c = 0; c < halo->consumerLength; c++) {
+			sent += halo->consumers[c].length;
+		}
+		fprintf(stderr, "WORKER %d> Halo of %d values from %d workers, %d values to %d workers, %d inputs through shared memory\n",
+			worker->id, received, halo->producerLength, sent, halo->consumerLength, halo->localGhostLength);
+		if (halo->active) {
+			long long updates = (long long)worker->numberOfOwnedNeurons * worker->model->simulationLength;
+			fprintf(stderr, "WORKER %d> Recalculated %lld of %lld neuron updates (%.1f%%), pushed in %d of %d time steps\n",
+				worker->id, halo->visited, updates, updates > 0 ? 100.0 * halo->visited / updates : 0,
+				halo->pushSteps, worker->model->simulationLength);
+		}
+		if (worker->options->cutDegree > 0) {
+			fprintf(stderr, "WORKER %d> %d of my hubs split over other workers, %d hub ranges calculated here, %d neurons replicated\n",
+				worker->id, halo->cutHubLength, halo->partLength, halo->replicaLength);
+		}
+	}
+
+	pthread_barrier_destroy(&halo->barrier);
+	pthread_cond_destroy(&halo->ready);
+	pthread_mutex_destroy(&halo->lock);
+	for (int thread = 0; thread < halo->computeThreads; thread++) {
+		metisFreeRing(&halo->rings[thread]);
+	}
+	free(halo->rings);
+	metisFreePeers(halo->producers, halo->producerLength);
+	metisFreePeers(halo->consumers, halo->consumerLength);
+	free(halo->localGhosts);
+	free(halo->sendOffsets);
+	free(halo->sendTargets);
+	free(halo->stimulated);
+	free(halo->stimulatedNow);
+	for (int p = 0; p < halo->partLength; p++) {
+		if (halo->parts[p].owner != worker->id) {
+			free(halo->parts[p].products);
+		}
+	}
+	free(halo->parts);
+	free(halo->cutHubs);
+	free(halo->cutProductOffsets);
+	free(halo->cutProducts);
+	free(halo->cutSources);
+	free(halo->cutRequests);
+	free(halo->replicated);
+	free(halo->replicas);
+	free(halo->replicaCounts);
+	free(halo->replicaDisplacements);
+	free(halo->replicaSend);
+	free(halo->replicaValues);
+	if (halo->active) {
+		free(halo->successorOffsets);
+		free(halo->successors);
+		free(halo->successorConnections);
+		free(halo->productOffsets);
+		free(halo->products);
+		free(halo->fresh);
+		free(halo->changedInputs);
+		free(halo->visitStamp);
+		free(halo->visit);
+		free(halo->changes);
+	}
+}
@@ -0,0 +1,403 @@
+// Products and sums have to be rounded one at a time like the scalar kernel does,
+// so the compiler may not fuse them into multiply-adds
+#if defined(__clang__)
+#pragma STDC FP_CONTRACT OFF
+#elif defined(__GNUC__)
+#pragma GCC optimize("fp-contract=off")
+#endif
+
+#include <string.h>
+#include "metis.h"
+#include "kernel.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define METIS_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+static void metisKernelScalar(const metisModel* model, const int* activityLevel, const int* neurons, int length, int* values) {
+	for (int i = 0; i < length; i++) {
+		int neuron = neurons[i];
+		double total = 0;
+		for (int connection = model->connectionOffsets[neuron]; connection < model->connectionOffsets[neuron + 1]; connection++) {
+			total += model->connectionSensitivities[connection] * activityLevel[model->connectionSources[connection]];
+		}
+
+		if (total <= 10)
+			values[i] = total;
+		else
+			values[i] = 10;
+	}
+}
+
+// Turn the exact integer sum of a quantized neuron into its activity level. A sum that is not
+// a whole number of scale truncates the same way as the double sum, whose rounding error is
+// far too small to cross an integer. Whole numbers other than 0 are where the double sum may
+// land just below, so those neurons are recalculated the way the scalar kernel does it
+static int metisQuantizedValue(const metisModel* model, const int* activityLevel, int neuron, int total) {
+	int value;
+
+	if (total == 0) {
+		return 0;
+	}
+	if (total % model->quantizedScale == 0) {
+		metisKernelScalar(model, activityLevel, &neuron, 1, &value);
+		return value;
+	}
+	return total > 10 * model->quantizedScale ? 10 : total / model->quantizedScale;
+}
+
+static void metisKernelQuantizedScalar(const metisModel* model, const int* activityLevel, const int* neurons, int length, int* values) {
+	const signed char* weights8 = model->quantizedSensitivities;
+	const short* weights16 = model->quantizedSensitivities;
+
+	for (int i = 0; i < length; i++) {
+		int neuron = neurons[i];
+		int total = 0;
+		if (model->quantizedBytes == 1) {
+			for (int connection = model->connectionOffsets[neuron]; connection < model->connectionOffsets[neuron + 1]; connection++) {
+				total += weights8[connection] * activityLevel[model->connectionSources[connection]];
+			}
+		}
+		else {
+			for (int connection = model->connectionOffsets[neuron]; connection < model->connectionOffsets[neuron + 1]; connection++) {
+				total += weights16[connection] * activityLevel[model->connectionSources[connection]];
+			}
+		}
+
+		values[i] = metisQuantizedValue(model, activityLevel, neuron, total);
+	}
+}
+
+static void metisSliceScalar(const double* weights, const int* sources, int stride, int height, int width, const int* activityLevel, int* values) {
+	double totals[METIS_KERNEL_BATCH];
+
+	for (int first = 0; first < height; first += METIS_KERNEL_BATCH) {
+		int length = height - first < METIS_KERNEL_BATCH ? height - first : METIS_KERNEL_BATCH;
+		for (int r = 0; r < length; r++) {
+			totals[r] = 0;
+		}
+
+		for (int j = 0; j < width; j++) {
+			const double* column = &weights[j * stride + first];
+			const int* columnSources = &sources[j * stride + first];
+			for (int r = 0; r < length; r++) {
+				totals[r] += column[r] * activityLevel[columnSources[r]];
+			}
+		}
+
+		for (int r = 0; r < length; r++) {
+			if (totals[r] <= 10)
+				values[first + r] = totals[r];
+			else
+				values[first + r] = 10;
+		}
+	}
+}
+
+#ifdef METIS_X86_KERNELS
+
+// Every lane sums up one neuron, so each total is built in the same order as the scalar
+// kernel. A lane whose neuron has run out of inputs keeps its total while the others go on
+__attribute__((target("avx2")))
+static void metisKernelAvx2(const metisModel* model, const int* activityLevel, const int* neurons, int length, int* values) {
+	const __m256d ten = _mm256_set1_pd(10);
+	int i = 0;
+
+	for (; i + 4 <= length; i += 4) {
+		__m128i ids = _mm_loadu_si128((const __m128i*)&neurons[i]);
+		__m128i first = _mm_i32gather_epi32(model->connectionOffsets, ids, 4);
+		__m128i degree = _mm_sub_epi32(_mm_i32gather_epi32(model->connectionOffsets + 1, ids, 4), first);
+
+		int degrees[4];
+		int maxDegree = 0;
+		_mm_storeu_si128((__m128i*)degrees, degree);
+		for (int lane = 0; lane < 4; lane++) {
+			if (degrees[lane] > maxDegree) {
+				maxDegree = degrees[lane];
+			}
+		}
+
+		__m256d total = _mm256_setzero_pd();
+		for (int j = 0; j < maxDegree; j++) {
+			__m128i edge = _mm_set1_epi32(j);
+			__m128i active = _mm_cmpgt_epi32(degree, edge);
+			__m256d activeWide = _mm256_castsi256_pd(_mm256_cvtepi32_epi64(active));
+			__m128i position = _mm_add_epi32(first, edge);
+
+			__m128i sources = _mm_mask_i32gather_epi32(_mm_setzero_si128(), model->connectionSources, position, active, 4);
+			__m128i inputs = _mm_mask_i32gather_epi32(_mm_setzero_si128(), activityLevel, sources, active, 4);
+			__m256d weights = _mm256_mask_i32gather_pd(_mm256_setzero_pd(), model->connectionSensitivities, position, activeWide, 8);
+
+			__m256d sum = _mm256_add_pd(total, _mm256_mul_pd(weights, _mm256_cvtepi32_pd(inputs)));
+			total = _mm256_blendv_pd(total, sum, activeWide);
+		}
+
+		// A total that is not at most 10, NaN included, becomes 10 before it is truncated
+		__m256d clamped = _mm256_blendv_pd(ten, total, _mm256_cmp_pd(total, ten, _CMP_LE_OQ));
+		_mm_storeu_si128((__m128i*)&values[i], _mm256_cvttpd_epi32(clamped));
+	}
+
+	metisKernelScalar(model, activityLevel, neurons + i, length - i, values + i);
+}
+
+__attribute__((target("avx512f,avx512vl,avx2")))
+static void metisKernelAvx512(const metisModel* model, const int* activityLevel, const int* neurons, int length, int* values) {
+	const __m512d ten = _mm512_set1_pd(10);
+	int i = 0;
+
+	for (; i + 8 <= length; i += 8) {
+		__m256i ids = _mm256_loadu_si256((const __m256i*)&neurons[i]);
+		__m256i first = _mm256_i32gather_epi32(model->connectionOffsets, ids, 4);
+		__m256i degree = _mm256_sub_epi32(_mm256_i32gather_epi32(model->connectionOffsets + 1, ids, 4), first);
+
+		int degrees[8];
+		int maxDegree = 0;
+		_mm256_storeu_si256((__m256i*)degrees, degree);
+		for (int lane = 0; lane < 8; lane++) {
+			if (degrees[lane] > maxDegree) {
+				maxDegree = degrees[lane];
+			}
+		}
+
+		__m512d total = _mm512_setzero_pd();
+		for (int j = 0; j < maxDegree; j++) {
+			__m256i edge = _mm256_set1_epi32(j);
+			__mmask8 active = _mm256_cmpgt_epi32_mask(degree, edge);
+			__m256i position = _mm256_add_epi32(first, edge);
+
+			__m256i sources = _mm256_mmask_i32gather_epi32(_mm256_setzero_si256(), active, position, model->connectionSources, 4);
+			__m256i inputs = _mm256_mmask_i32gather_epi32(_mm256_setzero_si256(), active, sources, activityLevel, 4);
+			__m512d weights = _mm512_mask_i32gather_pd(_mm512_setzero_pd(), active, position, model->connectionSensitivities, 8);
+
+			total = _mm512_mask_add_pd(total, active, total, _mm512_mul_pd(weights, _mm512_cvtepi32_pd(inputs)));
+		}
+
+		__m512d clamped = _mm512_mask_blend_pd(_mm512_cmp_pd_mask(total, ten, _CMP_LE_OQ), ten, total);
+		_mm256_storeu_si256((__m256i*)&values[i], _mm512_cvttpd_epi32(clamped));
+	}
+
+	metisKernelAvx2(model, activityLevel, neurons + i, length - i, values + i);
+}
+
+// Rows of a slice are next to each other, so only the activity levels have to be gathered
+__attribute__((target("avx2")))
+static void metisSliceAvx2(const double* weights, const int* sources, int stride, int height, int width, const int* activityLevel, int* values) {
+	const __m256d ten = _mm256_set1_pd(10);
+	int r = 0;
+
+	for (; r + 4 <= height; r += 4) {
+		__m256d total = _mm256_setzero_pd();
+		for (int j = 0; j < width; j++) {
+			__m128i columnSources = _mm_loadu_si128((const __m128i*)&sources[j * stride + r]);
+			__m128i inputs = _mm_i32gather_epi32(activityLevel, columnSources, 4);
+			__m256d column = _mm256_loadu_pd(&weights[j * stride + r]);
+			total = _mm256_add_pd(total, _mm256_mul_pd(column, _mm256_cvtepi32_pd(inputs)));
+		}
+
+		__m256d clamped = _mm256_blendv_pd(ten, total, _mm256_cmp_pd(total, ten, _CMP_LE_OQ));
+		_mm_storeu_si128((__m128i*)&values[r], _mm256_cvttpd_epi32(clamped));
+	}
+
+	metisSliceScalar(weights + r, sources + r, stride, height - r, width, activityLevel, values + r);
+}
+
+__attribute__((target("avx512f,avx512vl,avx2")))
+static void metisSliceAvx512(const double* weights, const int* sources, int stride, int height, int width, const int* activityLevel, int* values) {
+	const __m512d ten = _mm512_set1_pd(10);
+	int r = 0;
+
+	for (; r + 8 <= height; r += 8) {
+		__m512d total = _mm512_setzero_pd();
+		for (int j = 0; j < width; j++) {
+			__m256i columnSources = _mm256_loadu_si256((const __m256i*)&sources[j * stride + r]);
+			__m256i inputs = _mm256_i32gather_epi32(activityLevel, columnSources, 4);
+			__m512d column = _mm512_loadu_pd(&weights[j * stride + r]);
+			total = _mm512_add_pd(total, _mm512_mul_pd(column, _mm512_cvtepi32_pd(inputs)));
+		}
+
+		__m512d clamped = _mm512_mask_blend_pd(_mm512_cmp_pd_mask(total, ten, _CMP_LE_OQ), ten, total);
+		_mm256_storeu_si256((__m256i*)&values[r], _mm512_cvttpd_epi32(clamped));
+	}
+
+	metisSliceAvx2(weights + r, sources + r, stride, height - r, width, activityLevel, values + r);
+}
+
+// Integer lanes are half as wide as doubles, so twice as many neurons are summed at once.
+// Weights are gathered as whole ints at their byte offset and sign extended from the low bits
+__attribute__((target("avx2")))
+static void metisKernelQuantizedAvx2(const metisModel* model, const int* activityLevel, const int* neurons, int length, int* values) {
+	__m128i byteShift = _mm_cvtsi32_si128(model->quantizedBytes - 1);
+	__m128i signShift = _mm_cvtsi32_si128(32 - 8 * model->quantizedBytes);
+	int i = 0;
+
+	for (; i + 8 <= length; i += 8) {
+		__m256i ids = _mm256_loadu_si256((const __m256i*)&neurons[i]);
+		__m256i first = _mm256_i32gather_epi32(model->connectionOffsets, ids, 4);
+		__m256i degree = _mm256_sub_epi32(_mm256_i32gather_epi32(model->connectionOffsets + 1, ids, 4), first);
+
+		int degrees[8];
+		int maxDegree = 0;
+		_mm256_storeu_si256((__m256i*)degrees, degree);
+		for (int lane = 0; lane < 8; lane++) {
+			if (degrees[lane] > maxDegree) {
+				maxDegree = degrees[lane];
+			}
+		}
+
+		// Lanes that are done gather zeros, which leaves their sum as it is
+		__m256i total = _mm256_setzero_si256();
+		for (int j = 0; j < maxDegree; j++) {
+			__m256i edge = _mm256_set1_epi32(j);
+			__m256i active = _mm256_cmpgt_epi32(degree, edge);
+			__m256i position = _mm256_add_epi32(first, edge);
+
+			__m256i sources = _mm256_mask_i32gather_epi32(_mm256_setzero_si256(), model->connectionSources, position, active, 4);
+			__m256i inputs = _mm256_mask_i32gather_epi32(_mm256_setzero_si256(), activityLevel, sources, active, 4);
+			__m256i weights = _mm256_mask_i32gather_epi32(_mm256_setzero_si256(), model->quantizedSensitivities, _mm256_sll_epi32(position, byteShift), active, 1);
+			weights = _mm256_sra_epi32(_mm256_sll_epi32(weights, signShift), signShift);
+
+			total = _mm256_add_epi32(total, _mm256_mullo_epi32(weights, inputs));
+		}
+
+		int totals[8];
+		_mm256_storeu_si256((__m256i*)totals, total);
+		for (int lane = 0; lane < 8; lane++) {
+			values[i + lane] = metisQuantizedValue(model, activityLevel, neurons[i + lane], totals[lane]);
+		}
+	}
+
+	metisKernelQuantizedScalar(model, activityLevel, neurons + i, length - i, values + i);
+}
+
+__attribute__((target("avx512f,avx512vl,avx2")))
+static void metisKernelQuantizedAvx512(const metisModel* model, const int* activityLevel, const int* neurons, int length, int* values) {
+	__m128i byteShift = _mm_cvtsi32_si128(model->quantizedBytes - 1);
+	__m128i signShift = _mm_cvtsi32_si128(32 - 8 * model->quantizedBytes);
+	int i = 0;
+
+	for (; i + 16 <= length; i += 16) {
+		__m512i ids = _mm512_loadu_si512(&neurons[i]);
+		__m512i first = _mm512_i32gather_epi32(ids, model->connectionOffsets, 4);
+		__m512i degree = _mm512_sub_epi32(_mm512_i32gather_epi32(ids, model->connectionOffsets + 1, 4), first);
+		int maxDegree = _mm512_reduce_max_epi32(degree);
+
+		__m512i total = _mm512_setzero_si512();
+		for (int j = 0; j < maxDegree; j++) {
+			__m512i edge = _mm512_set1_epi32(j);
+			__mmask16 active = _mm512_cmpgt_epi32_mask(degree, edge);
+			__m512i position = _mm512_add_epi32(first, edge);
+
+			__m512i sources = _mm512_mask_i32gather_epi32(_mm512_setzero_si512(), active, position, model->connectionSources, 4);
+			__m512i inputs = _mm512_mask_i32gather_epi32(_mm512_setzero_si512(), active, sources, activityLevel, 4);
+			__m512i weights = _mm512_mask_i32gather_epi32(_mm512_setzero_si512(), active, _mm512_sll_epi32(position, byteShift), model->quantizedSensitivities, 1);
+			weights = _mm512_sra_epi32(_mm512_sll_epi32(weights, signShift), signShift);
+
+			total = _mm512_add_epi32(total, _mm512_mullo_epi32(weights, inputs));
+		}
+
+		int totals[16];
+		_mm512_storeu_si512(totals, total);
+		for (int lane = 0; lane < 16; lane++) {
+			values[i + lane] = metisQuantizedValue(model, activityLevel, neurons[i + lane], totals[lane]);
+		}
+	}
+
+	metisKernelQuantizedAvx2(model, activityLevel, neurons + i, length - i, values + i);
+}
+
+#endif
+
+static metisNeuronKernel selectedKernel = metisKernelScalar;
+static metisNeuronKernel selectedQuantizedKernel = metisKernelQuantizedScalar;
+static metisSliceKernel selectedSliceKernel = metisSliceScalar;
+static const char* selectedKernelName = "scalar";
+
+// Pick the kernel by name, 'auto' takes the widest one the CPU supports.
+// Returns false if the name is unknown or the CPU can not run that kernel
+bool metisSelectKernel(const char* name) {
+	bool automatic = strcmp(name, "auto") == 0;
+
+	if (automatic || strcmp(name, "scalar") == 0) {
+		selectedKernel = metisKernelScalar;
+		selectedQuantizedKernel = metisKernelQuantizedScalar;
+		selectedSliceKernel = metisSliceScalar;
+		selectedKernelName = "scalar";
+	}
+	else if (strcmp(name, "avx2") != 0 && strcmp(name, "avx512") != 0) {
+		return false;
+	}
+
+#ifdef METIS_X86_KERNELS
+	__builtin_cpu_init();
+	bool avx2 = __builtin_cpu_supports("avx2");
+	bool avx512 = avx2 && __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vl");
+
+	if ((automatic || strcmp(name, "avx2") == 0) && avx2) {
+		selectedKernel = metisKernelAvx2;
+		selectedQuantizedKernel = metisKernelQuantizedAvx2;
+		selectedSliceKernel = metisSliceAvx2;
+		selectedKernelName = "avx2";
+	}
+	if ((automatic || strcmp(name, "avx512") == 0) && avx512) {
+		selectedKernel = metisKernelAvx512;
+		selectedQuantizedKernel = metisKernelQuantizedAvx512;
+		selectedSliceKernel = metisSliceAvx512;
+		selectedKernelName = "avx512";
+	}
+#endif
+
+	return automatic || strcmp(name, selectedKernelName) == 0;
+}
+
+const char* metisKernelName() {
+	return selectedKernelName;
+}
+
+// Models with quantized weights are summed up in integers
+void metisCalculateNeurons(const metisModel* model, const int* activityLevel, const int* neurons, int length, int* values) {
+	if (model->quantizedSensitivities != NULL) {
+		selectedQuantizedKernel(model, activityLevel, neurons, length, values);
+	}
+	else {
+		selectedKernel(model, activityLevel, neurons, length, values);
+	}
+}
+
+// Calculate the next activity level of length neurons in every one of lanes scenarios. The
+// lanes of a neuron are stored next to each other, so every input is read once for all
+// scenarios, and each lane is summed up in input order like the scalar kernel
+void metisCalculateNeuronLanes(const metisModel* model, const int* activityLevel, int lanes, const int* neurons, int length, int* values) {
+	double totals[METIS_MAX_LANES];
+
+	if (lanes == 1) {
+		metisCalculateNeurons(model, activityLevel, neurons, length, values);
+		return;
+	}
+
+	for (int i = 0; i < length; i++) {
+		int neuron = neurons[i];
+		for (int lane = 0; lane < lanes; lane++) {
+			totals[lane] = 0;
+		}
+
+		for (int connection = model->connectionOffsets[neuron]; connection < model->connectionOffsets[neuron + 1]; connection++) {
+			double sensitivity = model->connectionSensitivities[connection];
+			const int* source = &activityLevel[model->connectionSources[connection] * lanes];
+			for (int lane = 0; lane < lanes; lane++) {
+				totals[lane] += sensitivity * source[lane];
+			}
+		}
+
+		for (int lane = 0; lane < lanes; lane++) {
+			if (totals[lane] <= 10)
+				values[i * lanes + lane] = totals[lane];
+			else
+				values[i * lanes + lane] = 10;
+		}
+	}
+}
+
+void metisCalculateSlice(const double* weights, const int* sources, int stride, int height, int width, const int* activityLevel, int* values) {
+	selectedSliceKernel(weights, sources, stride, height, width, activityLevel, values);
+}
@@ -0,0 +1,28 @@
+#ifndef METIS_KERNEL_H
+#define METIS_KERNEL_H
+
+#include <stdbool.h>
+
+struct metisModel;
+
+// Calculate the next activity level of length neurons into values. Every kernel adds
+// the weighted inputs of a neuron one by one in input order, so all of them give
+// exactly the same result
+typedef void (*metisNeuronKernel)(const struct metisModel* model, const int* activityLevel, const int* neurons, int length, int* values);
+
+// Calculate the next activity level of the height rows of a slice into values. Entry j of row r
+// is at j * stride + r, and every row adds up its entries in order like the neuron kernels
+typedef void (*metisSliceKernel)(const double* weights, const int* sources, int stride, int height, int width, const int* activityLevel, int* values);
+
+// Largest number of neurons callers hand to a kernel at once
+#define METIS_KERNEL_BATCH 64
+// Largest number of scenarios simulated side by side
+#define METIS_MAX_LANES 64
+
+bool metisSelectKernel(const char*);
+const char* metisKernelName();
+void metisCalculateNeurons(const struct metisModel*, const int*, const int*, int, int*);
+void metisCalculateNeuronLanes(const struct metisModel*, const int*, int, const int*, int, int*);
+void metisCalculateSlice(const double*, const int*, int, int, int, const int*, int*);
+
+#endif
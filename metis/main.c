@@ -3,102 +3,32 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <getopt.h>
+#include <unistd.h>
 #include "cJSON.h"
-
-#define METIS_MAX_NUERON_NAME 20
-#define METIS_MAX_IO_NAME 20
-#define METIX_MAX_IO_OUTPUT_PREFIX 20
-
-#define MASTER 0
-
-#define DEBUG 0
-#define OUTPUT_STATE 1
-
-// Message Types
-#define METIS_DATA_REQUEST		1
-#define METIS_TASK				2
-#define METIS_TIME_UPDATE		3
-#define METIS_TASK_DONE			4
-#define METIS_DATA_RESPONSE		5
-#define METIS_CONFIG			6
+#include "metis.h"
+#include "numa.h"
 
 const char DEFUALT_FILE[] = "model.json";
 
-struct metisNeuron;
-struct metisNeuronConnection;
-struct metisIoConnection;
-struct metisIO;
-struct metisConfig;
-
-typedef struct metisNeuronConnection {
-	struct metisNeuron* neuron;
-	double sensitivity;
-	struct metisNeuronConnection* next;
-} metisNeuronConnection;
-
-typedef struct metisIoConnection {
-	struct metisNeuron* neuron;
-	struct metisIoConnection* next;
-} metisIoConnection;
-
-typedef struct metisNeuron {
-	char name[METIS_MAX_NUERON_NAME];
-	struct metisNeuronConnection* connections;
-	int connectionsLength;
-	int nextValue;
-	int ownerId;
-	int id;
-	int activityLevel;
-	struct metisNeuron* next;
-} metisNeuron;
-
-typedef struct metisIO {
-	char name[METIS_MAX_IO_NAME];
-	int type;								// 0 = stimulus, 1 = reader
-	metisIoConnection* connections;
-	struct metisIO* next;
-	int connectionsLength;
-	int offset;
-	int duration;
-	int amplitude;
-	char outputPrefix[METIX_MAX_IO_OUTPUT_PREFIX];
-} metisIO;
-
-typedef struct metisConfig {
-	metisNeuron* neurons;
-	int neuronLength;
-	metisIO* io;
-	int ioLength;
-	int simulationLength;
-} metisConfig;
-
-
-cJSON* parseFile(char*);
-metisConfig* parseConfig(cJSON*);
-void metisAddConnection(metisNeuronConnection*, metisNeuronConnection*);
-void metisAddIoConnection(metisIoConnection*, metisIoConnection*);
-metisNeuronConnection* metisNewNeuronConnection(metisNeuron*, double);
-metisConfig* metisNewConfig();
-metisIO* metisNewIO();
-metisNeuron* metisNewNeuron();
-metisIoConnection* metisNewIoConnection();
-void metisFreeConfig(metisConfig*);
-void metisFreeIO(metisIO*);
-void metisFreeNeuron(metisNeuron*);
-void metisAddNeuronConnection(metisNeuron*, metisNeuronConnection*);
-void metisAddIOConnection(metisIO*, metisIoConnection*);
-void metisConfigAddNeuron(metisConfig*, metisNeuron*);
-void metisConfigAddIO(metisConfig*, metisIO*);
-metisNeuron* metisGetNeuronByName(metisConfig*, char*);
-void metisFreeIoConnections(metisIoConnection*);
-void metisFreeNeuronConnections(metisNeuronConnection*);
-void runMasterNode(metisConfig*, int);
-void runWorkerNode(metisConfig*, int, int);
-bool arrayContains(int*, int, int);
-
 int main(int argc, char** argv) {
-	// Initialize the MPI environment
-	MPI_Init(NULL, NULL);
+	metisOptions options;
+	if (!parseOptions(argc, argv, &options)) {
+		return 1;
+	}
+
+	// Converting traces needs neither MPI nor a model
+	if (options.traceToSim != NULL) {
+		return metisTraceToSim(options.traceToSim, options.traceStep, stdout) ? 0 : 1;
+	}
+	if (!metisSelectKernel(options.kernel)) {
+		fprintf(stderr, "Kernel '%s' is unknown or not supported by this CPU!\n", options.kernel);
+		return 1;
+	}
+
+	// Initialize the MPI environment, threaded workers need at least funneled support
+	int provided;
+	MPI_Init_thread(NULL, NULL, options.threadLevel, &provided);
 
 	// Get the number of processes
 	int world_size;
@@ -108,142 +38,506 @@ int main(int argc, char** argv) {
 	int world_rank;
 	MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
 
+	if (provided < options.threadLevel) {
+		if (provided >= MPI_THREAD_FUNNELED) {
+			if (world_rank == MASTER)
+				fprintf(stderr, "MPI does not support MPI_THREAD_MULTIPLE, only the main thread will communicate\n");
+			options.threadLevel = MPI_THREAD_FUNNELED;
+		}
+		else {
+			if (world_rank == MASTER && (options.threads > 1 || options.commThread))
+				fprintf(stderr, "MPI does not support threads, running with 1 thread per worker\n");
+			options.threadLevel = provided;
+			options.threads = 1;
+			options.commThread = false;
+			options.activeSet = false;
+			options.cutDegree = 0;
+			if (options.scenarioFile != NULL) {
+				if (world_rank == MASTER)
+					fprintf(stderr, "Scenarios are simulated by a communication thread, which needs MPI thread support!\n");
+				MPI_Finalize();
+				return 1;
+			}
+		}
+	}
+
 	// Get the name of the processor
 	char processor_name[MPI_MAX_PROCESSOR_NAME];
 	int name_len;
 	MPI_Get_processor_name(processor_name, &name_len);
-	char* filename;
 
-	if (argc > 1) {
-		filename = argv[1];
-	} else {
-		filename = DEFUALT_FILE;
-	}
-	//const char filename[] = "model.json";
+	// Group the ranks that share a host so they can exchange activity through shared memory
+	MPI_Comm nodeComm;
+	MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, world_rank, MPI_INFO_NULL, &nodeComm);
 
-	cJSON* file = parseFile(filename);
-	if (file == NULL) {
-		fprintf(stderr, "Failed to parse file '%s'\n", filename);
+	// One rank per host reads the file, the others map its copy of the model
+	metisModel* model = metisLoadModel(options.filename, nodeComm, options.hugePages);
+	if (model == NULL) {
 		MPI_Finalize();
 		return 1;
 	}
-	metisConfig* config = parseConfig(file);
-	if (config == NULL) {
+
+	// The integer copy of the weights is always built, but only used when asked for
+	if (options.quantize && model->quantizedSensitivities == NULL && world_rank == MASTER) {
+		fprintf(stderr, "The sensitivities can not be quantized exactly, using double weights\n");
+	}
+	if (!options.quantize) {
+		model->quantizedSensitivities = NULL;
+	}
+
+	// Every rank reads the scenarios, they are small next to the model
+	metisScenarios* scenarios = NULL;
+	if (options.scenarioFile != NULL) {
+		scenarios = metisLoadScenarios(options.scenarioFile, model);
+		if (scenarios == NULL) {
+			metisFreeModel(model);
+			MPI_Finalize();
+			return 1;
+		}
+
+		// The lanes of a neuron are summed up in doubles
+		model->quantizedSensitivities = NULL;
+	}
+
+	// The benchmark needs no workers, the master runs it on its own
+	if (options.benchmark) {
+		if (world_rank == MASTER) {
+			metisBenchmarkFormats(model);
+		}
+		if (scenarios != NULL) {
+			metisFreeScenarios(scenarios);
+		}
+		metisFreeModel(model);
+		MPI_Comm_free(&nodeComm);
 		MPI_Finalize();
-		return 1;
+		return 0;
 	}
 
 	// Check if the number of neurons is >= number of nodes
-	if (config->neuronLength < world_size - 1) {
+	if (model->neuronLength < world_size - 1) {
 		if (world_rank == 0) {
 			printf("There are more nodes then neurons!\n");
 			printf("Exiting...\n");
 		}
+		if (scenarios != NULL) {
+			metisFreeScenarios(scenarios);
+		}
+		metisFreeModel(model);
 		MPI_Finalize();
 		return 0;
 	}
 
 	if (world_rank == MASTER && DEBUG) {
 		printf("Successfully read the config!\n");
-		printf("Read %d neurons\n", config->neuronLength);
-		metisNeuron* cursor = config->neurons;
-		for (int i = 0; i < config->neuronLength; i++) {
-			printf("Neuron index %d:\n\tName: %s\n", i, cursor->name);
-			metisNeuronConnection* cur = cursor->connections;
-			for (int j = 0; j < cursor->connectionsLength; j++) {
-				printf("\t\tConnection Name: %s, sensitivity: %f\n", cur->neuron->name, cur->sensitivity);
-				cur = cur->next;
+		printf("Read %d neurons\n", model->neuronLength);
+		for (int i = 0; i < model->neuronLength; i++) {
+			printf("Neuron index %d:\n\tName: %s\n", i, model->neuronNames[i]);
+			for (int j = model->connectionOffsets[i]; j < model->connectionOffsets[i + 1]; j++) {
+				printf("\t\tConnection Name: %s, sensitivity: %f\n", model->neuronNames[model->connectionSources[j]], model->connectionSensitivities[j]);
 			}
-			cursor = cursor->next;
 		}
-		printf("Read %d io devices\n", config->ioLength);
-		printf("Sim length: %d\n", config->simulationLength);
+		printf("Read %d io devices\n", model->ioLength);
+		printf("Sim length: %d\n", model->simulationLength);
 	}
 
+	// Split hubs are reduced and replicated hubs shared among the workers only
+	MPI_Comm workerComm;
+	MPI_Comm_split(MPI_COMM_WORLD, world_rank == MASTER ? MPI_UNDEFINED : 0, world_rank, &workerComm);
+
 	// Test printing from different nodes
 	if (world_rank == 0) {
 		// I am master
-		runMasterNode(config, world_size);
+		runMasterNode(model, world_size, nodeComm);
 	}
 	else {
 		// I am a worker node
-		runWorkerNode(config, world_rank, world_size);
+		runWorkerNode(model, scenarios, &options, world_rank, world_size, nodeComm, workerComm);
+		MPI_Comm_free(&workerComm);
 	}
 
-	// Clean Up the memory used by our config object
-	metisFreeConfig(config);
+	// Clean Up the memory used by our model object
+	if (scenarios != NULL) {
+		metisFreeScenarios(scenarios);
+	}
+	metisFreeModel(model);
+	free(options.affinity);
 
 	if (world_rank == MASTER) {
 		if (DEBUG)
-			printf("Successfully freed all memory used by metis config object\n");
+			printf("Successfully freed all memory used by metis model object\n");
 	}
 
+	MPI_Comm_free(&nodeComm);
+
 	// Finalize the MPI environment.
 	MPI_Finalize();
 
 	return 0;
 }
 
-void runMasterNode(metisConfig* config, int numberOfNodes) {
+static void printUsage(char* program) {
+	fprintf(stderr, "Usage: %s [options] [model file]\n", program);
+	fprintf(stderr, "Options:\n");
+	fprintf(stderr, "  -t, --threads <count>      Threads used by each worker (default 1)\n");
+	fprintf(stderr, "      --mpi-thread <level>   Thread support MPI is started with, 'funneled' or 'multiple'.\n");
+	fprintf(stderr, "                             Only the main thread of a worker communicates either way (default funneled)\n");
+	fprintf(stderr, "      --schedule <kind>      'steal' lets idle threads take blocks from busy ones,\n");
+	fprintf(stderr, "                             'static' keeps every block on its first thread (default steal)\n");
+	fprintf(stderr, "      --comm-thread          Dedicate one thread of each worker to communication and exchange\n");
+	fprintf(stderr, "                             the inputs of a time step in one message per neighbouring worker\n");
+	fprintf(stderr, "      --active-set           Like --comm-thread, but only recalculate neurons with an input that\n");
+	fprintf(stderr, "                             changed in the last time step and only send the changes\n");
+	fprintf(stderr, "      --direction <kind>     With --active-set, 'pull' gathers the inputs of every changed neuron,\n");
+	fprintf(stderr, "                             'push' scatters every changed input to the neurons it feeds and\n");
+	fprintf(stderr, "                             'auto' picks the cheaper one every time step (default auto)\n");
+	fprintf(stderr, "      --kernel <name>        Neuron update kernel: 'auto', 'scalar', 'avx2' or 'avx512' (default auto)\n");
+	fprintf(stderr, "      --quantize             Sum up integer weights if every sensitivity is a whole number\n");
+	fprintf(stderr, "                             of a power of ten, with the same results as double weights\n");
+	fprintf(stderr, "      --scenarios <file>     Simulate every stimulus schedule in the file side by side in one pass,\n");
+	fprintf(stderr, "                             sharing the graph traversal and the messages (implies --comm-thread)\n");
+	fprintf(stderr, "      --format <kind>        Store the inputs of the neurons as 'csr', 'ell', 'sell' (SELL-C-sigma)\n");
+	fprintf(stderr, "                             or 'blocked' (propagation blocking) for the --comm-thread update,\n");
+	fprintf(stderr, "                             'auto' picks one from the degrees and the cache size (default auto)\n");
+	fprintf(stderr, "      --benchmark            Time the update of the whole model in every format and exit\n");
+	fprintf(stderr, "      --vertex-cut <degree>  Split the inputs of neurons with more inputs over several workers and\n");
+	fprintf(stderr, "                             replicate neurons with more outputs on every worker (implies --comm-thread)\n");
+	fprintf(stderr, "      --affinity <cpus>      Pin the threads of the workers of a host to these cpus in order,\n");
+	fprintf(stderr, "                             e.g. '0-7,16-23' (default not pinned)\n");
+	fprintf(stderr, "      --huge-pages           Back the model and the stored inputs with transparent huge pages\n");
+	fprintf(stderr, "      --record <prefix>      Let reader devices write their neurons to <prefix>.<device>.<worker>.txt,\n");
+	fprintf(stderr, "                             each line starting with the output prefix of the reader\n");
+	fprintf(stderr, "      --no-dump              Do not print every neuron each time step\n");
+	fprintf(stderr, "      --stats <file>         Write the number of neurons at each level and the mean level of the model\n");
+	fprintf(stderr, "                             and of every reader device per time step to this file\n");
+	fprintf(stderr, "      --stream <path>        Let every worker publish the neurons it owns each time step on the Unix\n");
+	fprintf(stderr, "                             socket <path>.<worker>, slow consumers miss time steps\n");
+	fprintf(stderr, "      --trace <prefix>       Let every worker write the neurons it owns to <prefix>.<worker>.trace\n");
+	fprintf(stderr, "                             in binary instead of rank 1 printing every neuron as text\n");
+	fprintf(stderr, "      --trace-file <file>    Let all workers write their neurons to one shared trace with collective MPI-IO\n");
+	fprintf(stderr, "      --aggregators <count>  Ranks that collect the shared trace and write it to the file system\n");
+	fprintf(stderr, "                             (default picked by MPI)\n");
+	fprintf(stderr, "      --trace-codec <name>   'xor' codes every time step of a --trace against the one before,\n");
+	fprintf(stderr, "                             'none' stores a byte per neuron (default xor)\n");
+	fprintf(stderr, "      --trace-buffers <count> Time steps a trace can be behind the simulation, written in the background,\n");
+	fprintf(stderr, "                             1 writes every time step in place (default 2)\n");
+	fprintf(stderr, "      --trace-to-sim <prefix> Print the traces with this prefix, or this shared trace, as text, like\n");
+	fprintf(stderr, "                             rank 1 does, and exit\n");
+	fprintf(stderr, "      --trace-step <time>    With --trace-to-sim, only print this time step\n");
+	fprintf(stderr, "      --report               Print timings to stderr when the simulation is done\n");
+	fprintf(stderr, "  -h, --help                 Show this message\n");
+}
+
+bool parseOptions(int argc, char** argv, metisOptions* options) {
+	static const struct option longOptions[] = {
+		{ "threads", required_argument, NULL, 't' },
+		{ "mpi-thread", required_argument, NULL, 'm' },
+		{ "schedule", required_argument, NULL, 's' },
+		{ "comm-thread", no_argument, NULL, 'c' },
+		{ "active-set", no_argument, NULL, 'a' },
+		{ "direction", required_argument, NULL, 'd' },
+		{ "kernel", required_argument, NULL, 'k' },
+		{ "quantize", no_argument, NULL, 'q' },
+		{ "scenarios", required_argument, NULL, 'b' },
+		{ "format", required_argument, NULL, 'f' },
+		{ "benchmark", no_argument, NULL, 'B' },
+		{ "vertex-cut", required_argument, NULL, 'v' },
+		{ "affinity", required_argument, NULL, 'p' },
+		{ "huge-pages", no_argument, NULL, 'H' },
+		{ "record", required_argument, NULL, 'R' },
+		{ "no-dump", no_argument, NULL, 'N' },
+		{ "stats", required_argument, NULL, 'M' },
+		{ "stream", required_argument, NULL, 'O' },
+		{ "trace", required_argument, NULL, 'T' },
+		{ "trace-file", required_argument, NULL, 'F' },
+		{ "aggregators", required_argument, NULL, 'A' },
+		{ "trace-codec", required_argument, NULL, 'C' },
+		{ "trace-buffers", required_argument, NULL, 'W' },
+		{ "trace-to-sim", required_argument, NULL, 'S' },
+		{ "trace-step", required_argument, NULL, 'I' },
+		{ "report", no_argument, NULL, 'r' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+	int option;
+
+	options->filename = (char*)DEFUALT_FILE;
+	options->threads = 1;
+	options->threadLevel = MPI_THREAD_FUNNELED;
+	options->steal = true;
+	options->commThread = false;
+	options->activeSet = false;
+	options->direction = METIS_AUTO;
+	options->kernel = "auto";
+	options->quantize = false;
+	options->scenarioFile = NULL;
+	options->format = METIS_FORMAT_AUTO;
+	options->benchmark = false;
+	options->affinity = NULL;
+	options->affinityLength = 0;
+	options->hugePages = false;
+	options->cutDegree = 0;
+	options->recordPrefix = NULL;
+	options->dump = true;
+	options->statsFile = NULL;
+	options->streamPath = NULL;
+	options->tracePrefix = NULL;
+	options->traceFile = NULL;
+	options->aggregators = 0;
+	options->traceCodec = METIS_CODEC_XOR;
+	options->traceBuffers = 2;
+	options->traceToSim = NULL;
+	options->traceStep = -1;
+	options->report = false;
+
+	while ((option = getopt_long(argc, argv, "t:h", longOptions, NULL)) != -1) {
+		switch (option) {
+		case 't':
+			options->threads = atoi(optarg);
+			if (options->threads < 1) {
+				fprintf(stderr, "Invalid thread count '%s'! It has to be at least 1\n", optarg);
+				return false;
+			}
+			break;
+		case 'm':
+			if (strcmp(optarg, "funneled") == 0) {
+				options->threadLevel = MPI_THREAD_FUNNELED;
+			}
+			else if (strcmp(optarg, "multiple") == 0) {
+				options->threadLevel = MPI_THREAD_MULTIPLE;
+			}
+			else {
+				fprintf(stderr, "Invalid MPI thread level '%s'! Use 'funneled' or 'multiple'\n", optarg);
+				return false;
+			}
+			break;
+		case 's':
+			if (strcmp(optarg, "steal") == 0) {
+				options->steal = true;
+			}
+			else if (strcmp(optarg, "static") == 0) {
+				options->steal = false;
+			}
+			else {
+				fprintf(stderr, "Invalid schedule '%s'! Use 'steal' or 'static'\n", optarg);
+				return false;
+			}
+			break;
+		case 'c':
+			options->commThread = true;
+			break;
+		case 'a':
+			options->activeSet = true;
+			options->commThread = true;
+			break;
+		case 'd':
+			if (strcmp(optarg, "pull") == 0) {
+				options->direction = METIS_PULL;
+			}
+			else if (strcmp(optarg, "push") == 0) {
+				options->direction = METIS_PUSH;
+			}
+			else if (strcmp(optarg, "auto") == 0) {
+				options->direction = METIS_AUTO;
+			}
+			else {
+				fprintf(stderr, "Invalid direction '%s'! Use 'pull', 'push' or 'auto'\n", optarg);
+				return false;
+			}
+			break;
+		case 'k':
+			options->kernel = optarg;
+			break;
+		case 'q':
+			options->quantize = true;
+			break;
+		case 'b':
+			options->scenarioFile = optarg;
+			options->commThread = true;
+			break;
+		case 'f':
+			if (strcmp(optarg, "csr") == 0) {
+				options->format = METIS_FORMAT_CSR;
+			}
+			else if (strcmp(optarg, "ell") == 0) {
+				options->format = METIS_FORMAT_ELL;
+			}
+			else if (strcmp(optarg, "sell") == 0) {
+				options->format = METIS_FORMAT_SELL;
+			}
+			else if (strcmp(optarg, "blocked") == 0) {
+				options->format = METIS_FORMAT_BLOCKED;
+			}
+			else if (strcmp(optarg, "auto") == 0) {
+				options->format = METIS_FORMAT_AUTO;
+			}
+			else {
+				fprintf(stderr, "Invalid format '%s'! Use 'csr', 'ell', 'sell', 'blocked' or 'auto'\n", optarg);
+				return false;
+			}
+			break;
+		case 'B':
+			options->benchmark = true;
+			break;
+		case 'v':
+			options->cutDegree = atoi(optarg);
+			if (options->cutDegree < 1) {
+				fprintf(stderr, "Invalid degree '%s'! It has to be at least 1\n", optarg);
+				return false;
+			}
+			options->commThread = true;
+			break;
+		case 'p':
+			free(options->affinity);
+			options->affinityLength = metisParseCpuList(optarg, &options->affinity);
+			if (options->affinityLength < 0) {
+				fprintf(stderr, "Invalid cpu list '%s'! Use cpus and ranges like '0-7,16-23'\n", optarg);
+				return false;
+			}
+			break;
+		case 'H':
+			options->hugePages = true;
+			break;
+		case 'R':
+			options->recordPrefix = optarg;
+			break;
+		case 'N':
+			options->dump = false;
+			break;
+		case 'M':
+			options->statsFile = optarg;
+			break;
+		case 'O':
+			options->streamPath = optarg;
+			break;
+		case 'T':
+			options->tracePrefix = optarg;
+			break;
+		case 'F':
+			options->traceFile = optarg;
+			break;
+		case 'A':
+			options->aggregators = atoi(optarg);
+			if (options->aggregators < 1) {
+				fprintf(stderr, "Invalid aggregator count '%s'! It has to be at least 1\n", optarg);
+				return false;
+			}
+			break;
+		case 'C':
+			if (strcmp(optarg, "xor") == 0) {
+				options->traceCodec = METIS_CODEC_XOR;
+			}
+			else if (strcmp(optarg, "none") == 0) {
+				options->traceCodec = METIS_CODEC_NONE;
+			}
+			else {
+				fprintf(stderr, "Invalid trace codec '%s'! Use 'xor' or 'none'\n", optarg);
+				return false;
+			}
+			break;
+		case 'W':
+			options->traceBuffers = atoi(optarg);
+			if (options->traceBuffers < 1) {
+				fprintf(stderr, "Invalid buffer count '%s'! It has to be at least 1\n", optarg);
+				return false;
+			}
+			break;
+		case 'S':
+			options->traceToSim = optarg;
+			break;
+		case 'I':
+			options->traceStep = atoi(optarg);
+			if (options->traceStep < 0) {
+				fprintf(stderr, "Invalid time step '%s'! It has to be at least 0\n", optarg);
+				return false;
+			}
+			break;
+		case 'r':
+			options->report = true;
+			break;
+		default:
+			printUsage(argv[0]);
+			return false;
+		}
+	}
+
+	if (optind < argc) {
+		options->filename = argv[optind];
+	}
+
+	if (options->scenarioFile != NULL && options->activeSet) {
+		fprintf(stderr, "Scenarios can not be simulated with an active set!\n");
+		return false;
+	}
+	if (options->cutDegree > 0 && options->activeSet) {
+		fprintf(stderr, "Hubs can not be split or replicated with an active set!\n");
+		return false;
+	}
+	if (options->tracePrefix != NULL && options->traceFile != NULL) {
+		fprintf(stderr, "Use either --trace or --trace-file!\n");
+		return false;
+	}
+
+	return true;
+}
+
+void runMasterNode(metisModel* model, int numberOfNodes, MPI_Comm nodeComm) {
 	// Assign nodeIds to neurons
-	metisNeuron* cursor = config->neurons;
+	int* ownerId = malloc(sizeof(int) * model->neuronLength);
 	int nodeId = 1;
-	for (int i = 0; i < config->neuronLength; i++) {
+	for (int i = 0; i < model->neuronLength; i++) {
 		if (DEBUG)
 			printf("MASTER> Assigned neuron %d to node %d\n", i, nodeId);
-		cursor->ownerId = nodeId;
+		ownerId[i] = nodeId;
 		nodeId = (nodeId + 1) % numberOfNodes;
 		if (nodeId == 0) {
 			nodeId++;
 		}
-		cursor = cursor->next;
 	}
 
-	int maxNumberOfNeuronsPerNode = config->neuronLength / (numberOfNodes - 1);
-	if (config->neuronLength % (numberOfNodes - 1) != 0) {
+	int maxNumberOfNeuronsPerNode = model->neuronLength / (numberOfNodes - 1);
+	if (model->neuronLength % (numberOfNodes - 1) != 0) {
 		maxNumberOfNeuronsPerNode++;
 	}
 	if (DEBUG)
 		printf("MASTER> Max number of neurons per node: %d\n", maxNumberOfNeuronsPerNode);
 
 	// Send neurons to assigned node
-	cursor = config->neurons;
 	for (int nodeId = 1; nodeId < numberOfNodes; nodeId++) {
 		int nodes[maxNumberOfNeuronsPerNode];
 		// Set the starting nodes to -1 to indicate they are not assigned
-		memset(nodes, -1, maxNumberOfNeuronsPerNode);
+		memset(nodes, -1, sizeof(int) * maxNumberOfNeuronsPerNode);
 
 		int nodeRef = 0;
-		for (int i = 0; i < config->neuronLength; i++) {
-			if (cursor->ownerId == nodeId) {
+		for (int i = 0; i < model->neuronLength; i++) {
+			if (ownerId[i] == nodeId) {
 				// Add the node to the list
-				nodes[nodeRef] = cursor->id;
+				nodes[nodeRef] = i;
 				nodeRef++;
 			}
-			cursor = cursor->next;
 		}
-		// Reset the cursor
-		cursor = config->neurons;
 
 		// Send the list to the client
 		MPI_Send(nodes, nodeRef, MPI_INT, nodeId, METIS_TASK, MPI_COMM_WORLD);
 	}
 
-	int nodePairs[config->neuronLength * 2];
-	int i = 0;
-	for (metisNeuron* cursor = config->neurons; cursor != NULL; cursor = cursor->next) {
-		nodePairs[i] = cursor->id;
-		nodePairs[i + 1] = cursor->ownerId;
-		i += 2;
+	int nodePairs[model->neuronLength * 2];
+	for (int i = 0; i < model->neuronLength; i++) {
+		nodePairs[i * 2] = i;
+		nodePairs[i * 2 + 1] = ownerId[i];
 	}
 	for (int j = 1; j < numberOfNodes; j++) {
-		MPI_Send(nodePairs, config->neuronLength * 2, MPI_INT, j, METIS_CONFIG, MPI_COMM_WORLD);
+		MPI_Send(nodePairs, model->neuronLength * 2, MPI_INT, j, METIS_CONFIG, MPI_COMM_WORLD);
 	}
+	free(ownerId);
+
+	// The master owns no neurons but the window is collective over every rank on the host
+	int* unusedActivity;
+	MPI_Win activityWindow = metisCreateActivityWindow(nodeComm, 0, &unusedActivity);
 
 	int time = 0;
 	int doneCount = 0;
 	// Main event loop
-	while (time < config->simulationLength) {
+	while (time < model->simulationLength) {
 		MPI_Status status;
 		int flag = 0;
 
@@ -268,108 +562,394 @@ void runMasterNode(metisConfig* config, int numberOfNodes) {
 	if (DEBUG)
 		printf("MASTER> Waiting for all nodes to finish...\n");
 	sleep(2);
+
+	MPI_Win_free(&activityWindow);
 }
 
-void runWorkerNode(metisConfig* config, int id, int numberOfNodes) {
-	// Initialize array to hold nodes I am responsible for
-	int maxNumberOfNeuronsPerNode = config->neuronLength / (numberOfNodes - 1);
-	if (config->neuronLength % (numberOfNodes - 1) != 0) {
-		maxNumberOfNeuronsPerNode++;
+// Add up the stored products of a hub in one lane in input order, which gives the same total as an unsplit neuron
+int metisReduceHub(const metisWorker* worker, int hub, int lane) {
+	const metisScheduler* scheduler = worker->scheduler;
+	double total = 0;
+	for (int edge = scheduler->hubEdgeOffsets[hub]; edge < scheduler->hubEdgeOffsets[hub + 1]; edge++) {
+		total += worker->hubProducts[edge * worker->lanes + lane];
 	}
 
-	int nodes[maxNumberOfNeuronsPerNode];
-	// Set the starting nodes to -1 to indicate they are not assigned
-	memset(nodes, -1, maxNumberOfNeuronsPerNode);
+	if (total <= 10)
+		return total;
+	else
+		return 10;
+}
 
+// Store the weighted inputs of a hub edge range in every lane for metisReduceHub
+void metisHubProducts(const metisWorker* worker, const metisBlock* block) {
+	const metisModel* model = worker->model;
+	int lanes = worker->lanes;
+	int connFirst = model->connectionOffsets[worker->nodes[block->first]];
+	double* products = &worker->hubProducts[worker->scheduler->hubEdgeOffsets[block->hub] * lanes];
+
+	for (int edge = block->edgeFirst; edge < block->edgeLast; edge++) {
+		int connection = connFirst + edge;
+		const int* source = &worker->activityLevel[model->connectionSources[connection] * lanes];
+		for (int lane = 0; lane < lanes; lane++) {
+			products[edge * lanes + lane] = model->connectionSensitivities[connection] * source[lane];
+		}
+	}
+}
 
-	MPI_Status status;
-	int nodePairs[config->neuronLength * 2];
-	MPI_Recv(nodes, maxNumberOfNeuronsPerNode, MPI_INT, MASTER, METIS_TASK, MPI_COMM_WORLD, &status);
-	MPI_Recv(nodePairs, config->neuronLength * 2, MPI_INT, MASTER, METIS_CONFIG, MPI_COMM_WORLD, &status);
-	int i = 0;
-	while (nodes[i] != -1 && i < maxNumberOfNeuronsPerNode) {
-		if (DEBUG)
-			printf("WORKER %d> I am responsible for neuron %d\n", id, nodes[i]);
-		i++;
+// Rank 1 prints what it knows about every neuron once a time step is done. A batch
+// prints every scenario in turn, each line starting with the scenario it belongs to.
+// With --trace every worker writes the neurons it owns to its trace instead. Readers
+// are recorded by the workers owning their neurons either way, and the summary of the
+// time step is added up over all workers. Every worker publishes its neurons to --stream
+void metisPrintState(const metisWorker* worker) {
+	if (worker->recorderLength > 0) {
+		metisRecord(worker, worker->recorders, worker->recorderLength);
+	}
+	if (worker->stream != NULL) {
+		metisWriteStream(worker->stream, worker->time, worker->activityLevel);
+	}
+	if (worker->stats != NULL) {
+		metisReduceStats(worker, worker->stats);
+	}
+
+	if (worker->trace != NULL) {
+		metisWriteTrace(worker->trace, worker->time, worker->activityLevel);
+	}
+	else if (!worker->options->dump) {
+		return;
+	}
+	else if (worker->text != NULL) {
+		for (int lane = 0; lane < worker->lanes; lane++) {
+			for (int neuron = 0; neuron < worker->model->neuronLength; neuron++) {
+				metisTextLine(worker->text, worker->scenarios == NULL ? -1 : lane, worker->time, neuron,
+					worker->activityLevel[neuron * worker->lanes + lane]);
+			}
+		}
+	}
+}
+
+// Apply the stimulus of the current time step to my neurons and publish their state
+static void metisApplyStimulus(int thread, int threadLength, void* arg) {
+	metisWorker* worker = arg;
+	metisModel* model = worker->model;
+	int first;
+	int last;
+
+	metisPoolRange(worker->numberOfOwnedNeurons, thread, threadLength, &first, &last);
+	if (first == last) {
+		return;
+	}
+
+	for (int io = 0; io < model->ioLength; io++) {
+		const metisModelIO* device = &model->io[io];
+		if (device->type == 0) {
+			for (int j = 0; j < device->connectionsLength; j++) {
+				int neuron = model->ioConnections[device->connectionOffset + j];
+				// My chunk holds the owned neurons with slots from first to last
+				if (worker->ownerId[neuron] == worker->id && worker->neuronSlot[neuron] >= first && worker->neuronSlot[neuron] < last) {
+					if (worker->time >= device->offset && worker->time < device->offset + device->duration) {
+						if (DEBUG)
+							printf("WORKER %d> Set neuron %s:%d to activity level 10\n", worker->id, model->neuronNames[neuron], neuron);
+						worker->activityLevel[neuron] = 10;
+					}
+				}
+			}
+		}
 	}
 
-	for (i = 0; i < config->neuronLength * 2; i +=2) {
-		for (metisNeuron* cursor = config->neurons; cursor != NULL; cursor = cursor->next) {
-			if (nodePairs[i] == cursor->id) {
-				cursor->ownerId = nodePairs[i + 1];
+	// Publish the state of my neurons for this time step to the workers on my host
+	for (int i = first; i < last; i++) {
+		worker->publishedActivity[i + 1] = worker->activityLevel[worker->nodes[i]];
+	}
+}
+
+// Dataflow state of the message loop. Every owned neuron counts the inputs it is still
+// missing, each input that arrives counts down the neurons it feeds and a neuron is
+// calculated exactly once, as soon as its count reaches zero
+typedef struct metisDataflow {
+	metisWorker* worker;
+	int* ghostInputs;						// per owned neuron, inputs owned by other workers
+	int* missingInputs;						// per owned neuron, inputs still unknown in the current time step
+	int* successorOffsets;					// per neuron, the owned neurons it is an input of are
+	int* successors;						// successors[successorOffsets[i] ... successorOffsets[i + 1]]
+	int* ready;								// owned neurons with every input known, not calculated yet
+	int readyLength;
+	int remaining;							// owned neurons not calculated yet in the current time step
+	int* remoteGhosts;						// inputs owned by workers on other hosts, requested one at a time
+	int remoteGhostLength;
+	int nextRequest;						// position in remoteGhosts of the next request of the current time step
+	int* localGhostOffsets;					// per worker on my host, the inputs it owns are
+	int* localGhosts;						// localGhosts[localGhostOffsets[p] ... localGhostOffsets[p + 1]]
+	bool* peerLoaded;						// per worker, its inputs of the current time step have been read
+} metisDataflow;
+
+// Work out once which owned neurons every input feeds and where the inputs I do not own come from
+static void metisPlanDataflow(metisDataflow* flow) {
+	metisWorker* worker = flow->worker;
+	metisModel* model = worker->model;
+	int owned = worker->numberOfOwnedNeurons;
+
+	flow->ghostInputs = calloc(owned + 1, sizeof(int));
+	flow->missingInputs = malloc(sizeof(int) * (owned + 1));
+	flow->ready = malloc(sizeof(int) * (owned + 1));
+	flow->successorOffsets = calloc(model->neuronLength + 1, sizeof(int));
+	for (int k = 0; k < owned; k++) {
+		int neuron = worker->nodes[k];
+		for (int connection = model->connectionOffsets[neuron]; connection < model->connectionOffsets[neuron + 1]; connection++) {
+			int source = model->connectionSources[connection];
+			flow->successorOffsets[source + 1]++;
+			if (worker->ownerId[source] != worker->id) {
+				flow->ghostInputs[k]++;
 			}
 		}
 	}
+	for (int neuron = 0; neuron < model->neuronLength; neuron++) {
+		flow->successorOffsets[neuron + 1] += flow->successorOffsets[neuron];
+	}
+
+	int* next = malloc(sizeof(int) * (model->neuronLength + 1));
+	memcpy(next, flow->successorOffsets, sizeof(int) * (model->neuronLength + 1));
+	flow->successors = malloc(sizeof(int) * (flow->successorOffsets[model->neuronLength] + 1));
+	for (int k = 0; k < owned; k++) {
+		int neuron = worker->nodes[k];
+		for (int connection = model->connectionOffsets[neuron]; connection < model->connectionOffsets[neuron + 1]; connection++) {
+			flow->successors[next[model->connectionSources[connection]]++] = k;
+		}
+	}
+	free(next);
+
+	// Inputs owned by workers on my host are read from their slices, grouped by owner
+	flow->localGhostOffsets = calloc(worker->numberOfNodes + 1, sizeof(int));
+	flow->remoteGhosts = malloc(sizeof(int) * (model->neuronLength + 1));
+	flow->remoteGhostLength = 0;
+	for (int neuron = 0; neuron < model->neuronLength; neuron++) {
+		int owner = worker->ownerId[neuron];
+		if (owner == worker->id || flow->successorOffsets[neuron] == flow->successorOffsets[neuron + 1]) {
+			continue;
+		}
+
+		if (worker->peerActivity[owner] != NULL) {
+			flow->localGhostOffsets[owner + 1]++;
+		}
+		else {
+			flow->remoteGhosts[flow->remoteGhostLength++] = neuron;
+		}
+	}
+	for (int peer = 0; peer < worker->numberOfNodes; peer++) {
+		flow->localGhostOffsets[peer + 1] += flow->localGhostOffsets[peer];
+	}
+
+	next = malloc(sizeof(int) * (worker->numberOfNodes + 1));
+	memcpy(next, flow->localGhostOffsets, sizeof(int) * (worker->numberOfNodes + 1));
+	flow->localGhosts = malloc(sizeof(int) * (flow->localGhostOffsets[worker->numberOfNodes] + 1));
+	for (int neuron = 0; neuron < model->neuronLength; neuron++) {
+		int owner = worker->ownerId[neuron];
+		if (owner != worker->id && worker->peerActivity[owner] != NULL && flow->successorOffsets[neuron] != flow->successorOffsets[neuron + 1]) {
+			flow->localGhosts[next[owner]++] = neuron;
+		}
+	}
+	free(next);
+
+	flow->peerLoaded = calloc(worker->numberOfNodes + 1, sizeof(bool));
+}
+
+static void metisFreeDataflow(metisDataflow* flow) {
+	free(flow->ghostInputs);
+	free(flow->missingInputs);
+	free(flow->ready);
+	free(flow->successorOffsets);
+	free(flow->successors);
+	free(flow->remoteGhosts);
+	free(flow->localGhostOffsets);
+	free(flow->localGhosts);
+	free(flow->peerLoaded);
+}
+
+// Reset the counters once the stimulus of a time step is applied, neurons fed only by
+// neurons I own are ready straight away
+static void metisStartDataflow(metisDataflow* flow) {
+	metisWorker* worker = flow->worker;
+
+	// An input of mine that is still unknown counts as 0
+	for (int k = 0; k < worker->numberOfOwnedNeurons; k++) {
+		int neuron = worker->nodes[k];
+		if (worker->activityLevel[neuron] == -1 && flow->successorOffsets[neuron] != flow->successorOffsets[neuron + 1]) {
+			worker->activityLevel[neuron] = 0;
+		}
+	}
+
+	flow->readyLength = 0;
+	for (int k = 0; k < worker->numberOfOwnedNeurons; k++) {
+		flow->missingInputs[k] = flow->ghostInputs[k];
+		if (flow->missingInputs[k] == 0) {
+			flow->ready[flow->readyLength++] = k;
+		}
+	}
+	flow->remaining = worker->numberOfOwnedNeurons;
+	flow->nextRequest = 0;
+	memset(flow->peerLoaded, 0, sizeof(bool) * worker->numberOfNodes);
+}
+
+// An input arrived, count it down for every neuron it feeds
+static void metisInputKnown(metisDataflow* flow, int neuron) {
+	for (int i = flow->successorOffsets[neuron]; i < flow->successorOffsets[neuron + 1]; i++) {
+		int k = flow->successors[i];
+		if (--flow->missingInputs[k] == 0) {
+			flow->ready[flow->readyLength++] = k;
+		}
+	}
+}
+
+// Read the inputs owned by the workers on my host that have published the current time step.
+// A worker can not overwrite its slice before I finish this step, so the values stay valid
+static void metisReadLocalGhosts(metisDataflow* flow) {
+	metisWorker* worker = flow->worker;
+
+	MPI_Win_sync(worker->activityWindow);
+	for (int peer = 0; peer < worker->numberOfNodes; peer++) {
+		if (flow->peerLoaded[peer] || flow->localGhostOffsets[peer] == flow->localGhostOffsets[peer + 1]) {
+			continue;
+		}
+		if (__atomic_load_n(&worker->peerActivity[peer][0], __ATOMIC_RELAXED) != worker->time) {
+			continue;
+		}
+
+		MPI_Win_sync(worker->activityWindow);
+		for (int i = flow->localGhostOffsets[peer]; i < flow->localGhostOffsets[peer + 1]; i++) {
+			int neuron = flow->localGhosts[i];
+			int value = worker->peerActivity[peer][worker->neuronSlot[neuron] + 1];
+			worker->activityLevel[neuron] = value == -1 ? 0 : value;
+			metisInputKnown(flow, neuron);
+		}
+		flow->peerLoaded[peer] = true;
+	}
+}
+
+// Calculate the next value of a block of ready neurons. The edge ranges of a hub only
+// store their products, the hub is added up by metisReduceReadyHubs
+static void metisUpdateReady(const metisBlock* block, int index, int thread, void* arg) {
+	metisWorker* worker = arg;
+	const int* ready = worker->scheduler->batch;
+	int batch[METIS_KERNEL_BATCH];
+	int values[METIS_KERNEL_BATCH];
+
+	(void)index;
+	(void)thread;
+	if (block->hub != -1) {
+		metisHubProducts(worker, block);
+		return;
+	}
+
+	for (int i = block->first; i < block->last; i += METIS_KERNEL_BATCH) {
+		int length = block->last - i < METIS_KERNEL_BATCH ? block->last - i : METIS_KERNEL_BATCH;
+		for (int b = 0; b < length; b++) {
+			batch[b] = worker->nodes[ready[i + b]];
+		}
+
+		metisCalculateNeurons(worker->model, worker->activityLevel, batch, length, values);
+		for (int b = 0; b < length; b++) {
+			worker->nextValue[batch[b]] = values[b];
+		}
+	}
+}
+
+// Add up the products of the ready hubs in input order, which gives the same total as an unsplit neuron
+static void metisReduceReadyHubs(int thread, int threadLength, void* arg) {
+	metisWorker* worker = arg;
+	metisScheduler* scheduler = worker->scheduler;
+	int first;
+	int last;
+
+	metisPoolRange(scheduler->batchLength - scheduler->batchRunLength, thread, threadLength, &first, &last);
+	for (int i = scheduler->batchRunLength + first; i < scheduler->batchRunLength + last; i++) {
+		int k = scheduler->batch[i];
+		worker->nextValue[worker->nodes[k]] = metisReduceHub(worker, scheduler->neuronHubs[k], 0);
+	}
+}
+
+// Run the simulation by requesting every missing input from its owner, one message per value
+static void runMessageLoop(metisWorker* worker) {
+	metisModel* model = worker->model;
+	int id = worker->id;
+	int numberOfNodes = worker->numberOfNodes;
 
 	bool loadedAllData = false;
 	bool needToSendDone = true;
-	bool gettingData = false;
 	bool needToHandleIO = true;
-	int time = 0;
+	int publishedTime = -1;
+	worker->gettingData = false;
+	worker->time = 0;
+
+	metisDataflow flow = { .worker = worker };
+	metisPlanDataflow(&flow);
+
+	// Requests for a time step I have not published yet are held until I do
+	int pendingRequests[numberOfNodes * 3];
+	int pendingRequestsLength = 0;
 
-	int * buffer = malloc((sizeof(int) * (numberOfNodes - 1) * 2) + MPI_BSEND_OVERHEAD);
-	MPI_Buffer_attach(buffer, (sizeof(int) * (numberOfNodes - 1) * 2) + MPI_BSEND_OVERHEAD);
+	int bufferSize = (numberOfNodes + 2) * (sizeof(int) * 3 + MPI_BSEND_OVERHEAD);
+	int * buffer = malloc(bufferSize);
+	MPI_Buffer_attach(buffer, bufferSize);
 
 	// Main event loop
-	while (time < config->simulationLength) {
+	while (worker->time < model->simulationLength) {
 		int flag;
 		MPI_Status status;
 
 		if(DEBUG)
-			printf("WORKER %d> On time unit %d\n", id, time);
+			printf("WORKER %d> On time unit %d\n", id, worker->time);
 		
 		// Handle IO
 		if (needToHandleIO)
 		{
-			metisIO* ioCursor = config->io;
-			while (ioCursor != NULL) {
-				if (ioCursor->type == 0) {
-					metisIoConnection* ioConnCursor = ioCursor->connections;
-					while (ioConnCursor != NULL) {
-						if (arrayContains(nodes, maxNumberOfNeuronsPerNode, ioConnCursor->neuron->id)) {
-							if (time >= ioCursor->offset && time < ioCursor->offset + ioCursor->duration) {
-								if (DEBUG)
-									printf("WORKER %d> Set neuron %s:%d to activity level 10\n", id, ioConnCursor->neuron->name, ioConnCursor->neuron->id);
-								ioConnCursor->neuron->activityLevel = 10;
-							}
-						}
-						ioConnCursor = ioConnCursor->next;
-					}
-				}
-				ioCursor = ioCursor->next;
-			}
+			metisPoolRun(worker->pool, metisApplyStimulus, worker);
 			needToHandleIO = false;
+
+			MPI_Win_sync(worker->activityWindow);
+			worker->publishedActivity[0] = worker->time;
+			MPI_Win_sync(worker->activityWindow);
+			publishedTime = worker->time;
+
+			metisStartDataflow(&flow);
 		}
 
 		// Check for data request
 		MPI_Iprobe(MPI_ANY_SOURCE, METIS_DATA_REQUEST, MPI_COMM_WORLD, &flag, &status);
 		if (flag == 1) {
 			// Handle data request
-			int data[2];
+			int* data = &pendingRequests[pendingRequestsLength * 3];
 			
-			MPI_Recv(data, 2, MPI_INT, MPI_ANY_SOURCE, METIS_DATA_REQUEST, MPI_COMM_WORLD, &status);
+			MPI_Recv(data, 3, MPI_INT, MPI_ANY_SOURCE, METIS_DATA_REQUEST, MPI_COMM_WORLD, &status);
+			pendingRequestsLength++;
 
 			if(DEBUG)
 				printf("WORKER %d> Receiving data request from node %d\n", id, data[1]);
+		}
 
-			// Locate the data in the config
-			metisNeuron* cursor = config->neurons;
-			while (cursor != NULL) {
-				if (cursor->id == data[0]) {
-					int response[3];
-					response[0] = cursor->activityLevel;
-					response[1] = id;
-					response[2] = data[0];
-					if (DEBUG)
-						printf("WORKER %d> Send value %d to worker %d\n", id, response[0], data[1]);
-					MPI_Bsend(response, 3, MPI_INT, data[1], METIS_DATA_RESPONSE, MPI_COMM_WORLD);
-					break;
-				}
-				cursor = cursor->next;
+		// Answer the requests for time steps I have published
+		for (int request = 0; request < pendingRequestsLength; request++) {
+			int* data = &pendingRequests[request * 3];
+			if (data[2] > publishedTime) {
+				continue;
 			}
-			if (cursor == NULL) {
+
+			if (data[0] >= 0 && data[0] < model->neuronLength) {
+				int response[3];
+				response[0] = worker->activityLevel[data[0]];
+				response[1] = id;
+				response[2] = data[0];
+				if (DEBUG)
+					printf("WORKER %d> Send value %d to worker %d\n", id, response[0], data[1]);
+				MPI_Bsend(response, 3, MPI_INT, data[1], METIS_DATA_RESPONSE, MPI_COMM_WORLD);
+			}
+			else {
 				printf("WORKER %d> Failed to find node with id %d from worker %d\n", id, data[0], data[1]);
 			}
+
+			// Remove the request by moving the last one into its place
+			pendingRequestsLength--;
+			memmove(data, &pendingRequests[pendingRequestsLength * 3], sizeof(int) * 3);
+			request--;
 		}
 
 		MPI_Iprobe(MPI_ANY_SOURCE, METIS_DATA_RESPONSE, MPI_COMM_WORLD, &flag, &status);
@@ -380,22 +960,16 @@ void runWorkerNode(metisConfig* config, int id, int numberOfNodes) {
 
 			if (DEBUG)
 				printf("WORKER %d> Received data response from node %d\n", id, message[1]);
-			metisNeuron* cursor = config->neurons;
-			while (cursor != NULL) {
-				if (cursor->id == message[2]) {
-					if (DEBUG)
-						printf("WORKER %d> Updated neuron %d with value %d from worker %d\n", id, message[2], message[0], message[1]);
-					if (message[0] == -1) {
-						cursor->activityLevel = 0;
-					}
-					else {
-						cursor->activityLevel = message[0];
-					}
-					gettingData = false;
-					break;
-				}
-				cursor = cursor->next;
+			if (DEBUG)
+				printf("WORKER %d> Updated neuron %d with value %d from worker %d\n", id, message[2], message[0], message[1]);
+			if (message[0] == -1) {
+				worker->activityLevel[message[2]] = 0;
+			}
+			else {
+				worker->activityLevel[message[2]] = message[0];
 			}
+			worker->gettingData = false;
+			metisInputKnown(&flow, message[2]);
 		}
 		flag = 0;
 
@@ -407,30 +981,22 @@ void runWorkerNode(metisConfig* config, int id, int numberOfNodes) {
 			if (DEBUG)
 				printf("WORKER %d> Received time update from master\n", id);
 
-			if (id == 1 && OUTPUT_STATE) {
-				metisNeuron* cursor = config->neurons;
-				while (cursor != NULL) {
-					printf("Time:%d\tNeuron:%d\tActivity Level:%d\n", time, cursor->id, cursor->activityLevel);
-					cursor = cursor->next;
-				}
-			}
+			metisPrintState(worker);
 
-			metisNeuron* cursor = config->neurons;
-			while (cursor != NULL) {
-				if (arrayContains(nodes, maxNumberOfNeuronsPerNode, cursor->id)) {
-					cursor->activityLevel = cursor->nextValue;
-					cursor->nextValue = -1;
+			for (int neuron = 0; neuron < model->neuronLength; neuron++) {
+				if (worker->ownerId[neuron] == id) {
+					worker->activityLevel[neuron] = worker->nextValue[neuron];
+					worker->nextValue[neuron] = -1;
 				}
 				else {
-					cursor->activityLevel = -1;
+					worker->activityLevel[neuron] = -1;
 				}
-				cursor = cursor->next;
 			}
 			needToSendDone = true;
 			loadedAllData = false;
-			gettingData = false;
+			worker->gettingData = false;
 			needToHandleIO = true;
-			time++;
+			worker->time++;
 			if (DEBUG)
 				printf("WORKER %d> Finished resetting after time step\n", id);
 		}
@@ -445,81 +1011,396 @@ void runWorkerNode(metisConfig* config, int id, int numberOfNodes) {
 			needToSendDone = false;
 		}
 
-		// Check if I have all of the data needed to calculate the next state of my neurons
-		if (!loadedAllData) {
-			//printf("WORKER %d> Has not received all data to calculate next state\n", id);
-			metisNeuron* cursor = config->neurons;
-			while (cursor != NULL) {
-				if (arrayContains(nodes, maxNumberOfNeuronsPerNode, cursor->id)) {
-					metisNeuronConnection* connCursor = cursor->connections;
-					int i = 0;
-					while (connCursor != NULL) {
-						if (connCursor->neuron->activityLevel == -1) {
-							if (!arrayContains(nodes, maxNumberOfNeuronsPerNode, connCursor->neuron->id)) {
-								if (!gettingData) {
-									// Get the value from the responsible node
-									int data[2];
-									data[0] = connCursor->neuron->id;
-									data[1] = id;
-									if (DEBUG)
-										printf("WORKER %d> Requesting info about neuron %d from node %d\n", id, data[0], connCursor->neuron->ownerId);
-
-									MPI_Bsend(data, 2, MPI_INT, connCursor->neuron->ownerId, METIS_DATA_REQUEST, MPI_COMM_WORLD);
-									gettingData = true;
-								}
-							}
-							else {
-								connCursor->neuron->activityLevel = 0;
-							}
-						}
-						else {
-							i++;
-							if (DEBUG)
-								printf("WORKER %d> Data found... %d out of %d\n", id, i, cursor->connectionsLength);
-						}
-						connCursor = connCursor->next;
-					}
-					if (i == cursor->connectionsLength) {
-						// Calculate next value
-						connCursor = cursor->connections;
-						double total = 0;
-						while (connCursor != NULL) {
-							total += connCursor->sensitivity * connCursor->neuron->activityLevel;
-							connCursor = connCursor->next;
-						}
-
-						if (total <= 10)
-							cursor->nextValue = total;
-						else
-							cursor->nextValue = 10;
-					}
-				}
-				cursor = cursor->next;
+		// Calculate the neurons whose inputs are all known, the stimulus of this time step has
+		// to be applied before anything is calculated
+		if (!loadedAllData && !needToHandleIO) {
+			metisReadLocalGhosts(&flow);
+
+			// Get the next value I am missing from the responsible node, one request at a time
+			if (!worker->gettingData && flow.nextRequest < flow.remoteGhostLength) {
+				int source = flow.remoteGhosts[flow.nextRequest++];
+				int data[3];
+				data[0] = source;
+				data[1] = id;
+				data[2] = worker->time;
+				if (DEBUG)
+					printf("WORKER %d> Requesting info about neuron %d from node %d\n", id, data[0], worker->ownerId[source]);
+
+				MPI_Bsend(data, 3, MPI_INT, worker->ownerId[source], METIS_DATA_REQUEST, MPI_COMM_WORLD);
+				worker->gettingData = true;
 			}
-		}
 
-		// Check if all data is loaded
-		if (!loadedAllData) {
-			loadedAllData = true;
-			metisNeuron* cursor = config->neurons;
-			while (cursor != NULL) {
-				if (arrayContains(nodes, maxNumberOfNeuronsPerNode, cursor->id) && cursor->nextValue == -1) {
-					loadedAllData = false;
+			if (flow.readyLength > 0) {
+				metisSchedulerBatch(worker->scheduler, flow.ready, flow.readyLength);
+				metisSchedulerRun(worker->scheduler, worker->pool, metisUpdateReady, worker);
+				if (worker->scheduler->batchRunLength < worker->scheduler->batchLength) {
+					metisPoolRun(worker->pool, metisReduceReadyHubs, worker);
 				}
-				cursor = cursor->next;
+				flow.remaining -= flow.readyLength;
+				flow.readyLength = 0;
 			}
+			loadedAllData = flow.remaining == 0;
 		}
 	}
+
+	metisFreeDataflow(&flow);
+	MPI_Buffer_detach(&buffer, &bufferSize);
 	free(buffer);
 }
 
-bool arrayContains(int arr[], int arrayLength, int val) {
-	for (int i = 0; i < arrayLength; i++) {
-		if (arr[i] == val) {
-			return true;
+// Where the threads of a worker go, every worker of a host takes the next threads of the affinity map
+typedef struct metisPlacement {
+	metisWorker* worker;
+	int nodeRank;
+} metisPlacement;
+
+// Pin a thread of the pool, then first touch its share of the activity levels and the stored
+// inputs of the blocks the scheduler gives it, so they are placed on the socket of the thread
+static void metisPlaceThread(int thread, int threadLength, void* arg) {
+	metisPlacement* placement = arg;
+	metisWorker* worker = placement->worker;
+	metisOptions* options = worker->options;
+	metisScheduler* scheduler = worker->scheduler;
+	int first;
+	int last;
+
+	if (options->affinityLength > 0) {
+		int cpu = options->affinity[(placement->nodeRank * threadLength + thread) % options->affinityLength];
+		if (!metisPinThread(cpu)) {
+			fprintf(stderr, "WORKER %d> Failed to pin thread %d to cpu %d\n", worker->id, thread, cpu);
+		}
+	}
+	worker->threadSockets[thread] = metisCurrentSocket();
+
+	metisPoolRange(worker->model->neuronLength * worker->lanes, thread, threadLength, &first, &last);
+	for (int i = first; i < last; i++) {
+		worker->activityLevel[i] = -1;
+		worker->nextValue[i] = -1;
+	}
+
+	// With a communication thread, scheduler thread t is pool thread t + 1
+	int computeThread = options->commThread ? thread - 1 : thread;
+	if (computeThread < 0 || computeThread >= scheduler->threadLength) {
+		return;
+	}
+
+	const metisDeque* deque = &scheduler->deques[computeThread];
+	for (int i = 0; i < deque->length; i++) {
+		const metisBlock* block = &scheduler->blocks[deque->blocks[i]];
+		metisFillMatrixBlock(worker->matrix, worker->model, worker->nodes, deque->blocks[i]);
+		if (block->hub != -1) {
+			int edge = scheduler->hubEdgeOffsets[block->hub];
+			memset(&worker->hubProducts[(edge + block->edgeFirst) * worker->lanes], 0, sizeof(double) * (block->edgeLast - block->edgeFirst) * worker->lanes);
+		}
+	}
+}
+
+// Estimate the memory traffic of the update on every socket from the inputs its threads read.
+// An input reads its weight, its source and the activity level of the source
+static void metisReportSockets(const metisWorker* worker) {
+	const metisScheduler* scheduler = worker->scheduler;
+	const metisMatrix* matrix = worker->matrix;
+	const metisModel* model = worker->model;
+	int weightBytes = model->quantizedSensitivities != NULL ? model->quantizedBytes : (int)sizeof(double);
+	double entriesPerInput = matrix->connections > 0 ? (double)matrix->entries / matrix->connections : 1;
+	double bytesPerInput = entriesPerInput * (weightBytes + sizeof(int)) + sizeof(int) * worker->lanes;
+
+	int sockets = 0;
+	for (int thread = 0; thread < worker->pool->threadLength; thread++) {
+		if (worker->threadSockets[thread] >= sockets) {
+			sockets = worker->threadSockets[thread] + 1;
+		}
+	}
+
+	for (int socket = 0; socket < sockets; socket++) {
+		int threads = 0;
+		long long inputs = 0;
+		double busiest = 0;
+		for (int thread = 0; thread < scheduler->threadLength; thread++) {
+			int poolThread = worker->options->commThread ? thread + 1 : thread;
+			if (worker->threadSockets[poolThread] != socket) {
+				continue;
+			}
+
+			threads++;
+			inputs += scheduler->busyInputs[thread];
+			busiest = scheduler->busyTime[thread] > busiest ? scheduler->busyTime[thread] : busiest;
+		}
+		if (threads == 0) {
+			continue;
+		}
+
+		double bytes = inputs * bytesPerInput;
+		fprintf(stderr, "WORKER %d> Socket %d: %d threads read %.1f MB of inputs, about %.2f GB/s\n", worker->id, socket, threads,
+			bytes * 1e-6, busiest > 0 ? bytes / busiest * 1e-9 : 0);
+	}
+}
+
+void runWorkerNode(metisModel* model, const metisScenarios* scenarios, metisOptions* options, int id, int numberOfNodes, MPI_Comm nodeComm, MPI_Comm workerComm) {
+	metisWorker workerState;
+	metisWorker* worker = &workerState;
+
+	worker->model = model;
+	worker->options = options;
+	worker->scenarios = scenarios;
+	worker->lanes = scenarios != NULL ? scenarios->length : 1;
+	worker->id = id;
+	worker->numberOfNodes = numberOfNodes;
+	worker->workerComm = workerComm;
+
+	// Initialize array to hold nodes I am responsible for
+	int maxNumberOfNeuronsPerNode = model->neuronLength / (numberOfNodes - 1);
+	if (model->neuronLength % (numberOfNodes - 1) != 0) {
+		maxNumberOfNeuronsPerNode++;
+	}
+	worker->maxNumberOfNeuronsPerNode = maxNumberOfNeuronsPerNode;
+
+	int* nodes = malloc(sizeof(int) * maxNumberOfNeuronsPerNode);
+	// Set the starting nodes to -1 to indicate they are not assigned
+	memset(nodes, -1, sizeof(int) * maxNumberOfNeuronsPerNode);
+	worker->nodes = nodes;
+
+
+	MPI_Status status;
+	int nodePairs[model->neuronLength * 2];
+	MPI_Recv(nodes, maxNumberOfNeuronsPerNode, MPI_INT, MASTER, METIS_TASK, MPI_COMM_WORLD, &status);
+	MPI_Get_count(&status, MPI_INT, &worker->numberOfOwnedNeurons);
+	MPI_Recv(nodePairs, model->neuronLength * 2, MPI_INT, MASTER, METIS_CONFIG, MPI_COMM_WORLD, &status);
+	int i = 0;
+	while (i < maxNumberOfNeuronsPerNode && nodes[i] != -1) {
+		if (DEBUG)
+			printf("WORKER %d> I am responsible for neuron %d\n", id, nodes[i]);
+		i++;
+	}
+
+	worker->trace = NULL;
+	if (options->tracePrefix != NULL) {
+		worker->trace = metisOpenTrace(options->tracePrefix, id, numberOfNodes - 1, model->neuronLength, model->simulationLength,
+			worker->lanes, scenarios != NULL, nodes, worker->numberOfOwnedNeurons, options->traceBuffers, options->traceCodec);
+		if (worker->trace == NULL) {
+			MPI_Abort(MPI_COMM_WORLD, 1);
 		}
 	}
-	return false;
+	else if (options->traceFile != NULL) {
+		worker->trace = metisOpenSharedTrace(options->traceFile, workerComm, options->aggregators, id, numberOfNodes - 1, model->neuronLength,
+			model->simulationLength, worker->lanes, scenarios != NULL, nodes, worker->numberOfOwnedNeurons, options->traceBuffers);
+		if (worker->trace == NULL) {
+			MPI_Abort(MPI_COMM_WORLD, 1);
+		}
+	}
+
+	// Rank 1 prints every neuron as text unless it is traced, through a buffer written with one call
+	worker->text = NULL;
+	if (id == 1 && options->dump && worker->trace == NULL) {
+		fflush(stdout);
+		worker->text = metisNewText(STDOUT_FILENO, METIS_TEXT_BUFFER);
+	}
+
+	worker->stream = NULL;
+	if (options->streamPath != NULL) {
+		worker->stream = metisOpenStream(options->streamPath, id, numberOfNodes - 1, model->neuronLength, model->simulationLength,
+			worker->lanes, scenarios != NULL, nodes, worker->numberOfOwnedNeurons);
+		if (worker->stream == NULL) {
+			MPI_Abort(MPI_COMM_WORLD, 1);
+		}
+	}
+
+	// The model is shared by the whole host, the state of the simulation is private to this
+	// worker. The activity levels are first touched by the threads, see metisPlaceThread
+	worker->ownerId = malloc(sizeof(int) * model->neuronLength);
+	worker->activityLevel = malloc(sizeof(int) * model->neuronLength * worker->lanes);
+	worker->nextValue = malloc(sizeof(int) * model->neuronLength * worker->lanes);
+
+	for (i = 0; i < model->neuronLength * 2; i += 2) {
+		worker->ownerId[nodePairs[i]] = nodePairs[i + 1];
+	}
+
+	worker->recorders = NULL;
+	worker->recorderLength = 0;
+	if (options->recordPrefix != NULL) {
+		worker->recorderLength = metisOpenRecorders(worker, options->recordPrefix, &worker->recorders);
+		if (worker->recorderLength < 0) {
+			MPI_Abort(MPI_COMM_WORLD, 1);
+		}
+	}
+
+	worker->stats = NULL;
+	if (options->statsFile != NULL) {
+		worker->stats = metisOpenStats(worker, options->statsFile);
+		if (worker->stats == NULL) {
+			MPI_Abort(MPI_COMM_WORLD, 1);
+		}
+	}
+
+	// Every owner lists its neurons in id order, so the slot of a neuron in its
+	// owner's slice of the activity window is the number of lower ids with the same owner
+	worker->neuronSlot = malloc(sizeof(int) * model->neuronLength);
+	int* ownedCount = calloc(numberOfNodes, sizeof(int));
+	for (i = 0; i < model->neuronLength * 2; i += 2) {
+		worker->neuronSlot[nodePairs[i]] = ownedCount[nodePairs[i + 1]]++;
+	}
+	free(ownedCount);
+
+	// Slot 0 of my slice holds the last time step I published, the remaining
+	// slots hold the activity level of my neurons in the order of nodes[], lane by lane
+	worker->activityWindow = metisCreateActivityWindow(nodeComm, worker->numberOfOwnedNeurons * worker->lanes + 1, &worker->publishedActivity);
+	MPI_Win_lock_all(MPI_MODE_NOCHECK, worker->activityWindow);
+
+	// Map the slices of the workers running on the same host, ranks on other hosts stay NULL
+	worker->peerActivity = malloc(sizeof(int*) * numberOfNodes);
+	MPI_Group worldGroup;
+	MPI_Group nodeGroup;
+	MPI_Comm_group(MPI_COMM_WORLD, &worldGroup);
+	MPI_Comm_group(nodeComm, &nodeGroup);
+	for (int peer = 0; peer < numberOfNodes; peer++) {
+		int peerNodeRank;
+		worker->peerActivity[peer] = NULL;
+		MPI_Group_translate_ranks(worldGroup, 1, &peer, nodeGroup, &peerNodeRank);
+		if (peer != MASTER && peer != id && peerNodeRank != MPI_UNDEFINED) {
+			MPI_Aint size;
+			int dispUnit;
+			MPI_Win_shared_query(worker->activityWindow, peerNodeRank, &size, &dispUnit, &worker->peerActivity[peer]);
+			if (DEBUG)
+				printf("WORKER %d> Reading worker %d through shared memory\n", id, peer);
+		}
+	}
+	MPI_Group_free(&worldGroup);
+	MPI_Group_free(&nodeGroup);
+
+	// The IO and update phases are split over the threads of the pool. With a
+	// communication thread the main thread only communicates and the rest compute
+	int computeThreads = options->threads;
+	worker->pool = metisNewPool(options->commThread ? computeThreads + 1 : computeThreads);
+
+	// Both engines run blocks of about equal input count, hubs are split into edge ranges
+	int* inputCounts = malloc(sizeof(int) * (worker->numberOfOwnedNeurons + 1));
+	for (i = 0; i < worker->numberOfOwnedNeurons; i++) {
+		inputCounts[i] = model->connectionOffsets[nodes[i] + 1] - model->connectionOffsets[nodes[i]];
+
+		// Hubs split over several workers are calculated by the halo engine on its own
+		if (options->commThread && metisCutSegments(worker, nodes[i]) > 1) {
+			inputCounts[i] = -1;
+		}
+	}
+	worker->scheduler = metisNewScheduler(inputCounts, worker->numberOfOwnedNeurons, computeThreads, options->steal);
+	worker->hubProducts = metisAllocLarge(sizeof(double) * (worker->scheduler->hubEdgeLength + 1) * worker->lanes, options->hugePages);
+	free(inputCounts);
+
+	// Only the dense update of the halo engine runs whole blocks, which is what the formats
+	// lay out. Quantized weights are summed up by the CSR kernels unless a format is asked for
+	int format = options->format;
+	if (!options->commThread || options->activeSet || worker->lanes > 1) {
+		format = METIS_FORMAT_CSR;
+	}
+	else if (format == METIS_FORMAT_AUTO && model->quantizedSensitivities != NULL) {
+		format = METIS_FORMAT_CSR;
+	}
+	worker->matrix = metisNewMatrix(model, nodes, worker->scheduler, format, options->hugePages);
+
+	// Pin the threads and let each one touch the state it works on first
+	metisPlacement placement;
+	placement.worker = worker;
+	MPI_Comm_rank(nodeComm, &placement.nodeRank);
+	worker->threadSockets = malloc(sizeof(int) * worker->pool->threadLength);
+	metisPoolRun(worker->pool, metisPlaceThread, &placement);
+
+	if (options->commThread) {
+		// One thread does all of the communication while the others compute
+		runHaloWorker(worker);
+	}
+	else {
+		runMessageLoop(worker);
+	}
+
+	// The writer may still be behind, finishing the trace counts as waiting on it
+	if (worker->trace != NULL) {
+		metisCloseTrace(worker->trace);
+	}
+	if (worker->stats != NULL) {
+		metisCloseStats(worker, worker->stats);
+	}
+	if (worker->text != NULL) {
+		metisFreeText(worker->text);
+	}
+
+	if (options->report) {
+		// Compare how long each thread spent gathering and updating
+		metisScheduler* scheduler = worker->scheduler;
+		double busiest = 0;
+		double average = 0;
+		for (int thread = 0; thread < scheduler->threadLength; thread++) {
+			fprintf(stderr, "WORKER %d> Thread %d spent %.6f s updating neurons\n", id, thread, scheduler->busyTime[thread]);
+			if (scheduler->busyTime[thread] > busiest) {
+				busiest = scheduler->busyTime[thread];
+			}
+			average += scheduler->busyTime[thread] / scheduler->threadLength;
+		}
+		if (options->commThread) {
+			fprintf(stderr, "WORKER %d> %d blocks, %d hubs", id, scheduler->blockLength, scheduler->hubLength);
+		}
+		else {
+			// The message loop runs the neurons as they become ready, in batches of blocks
+			fprintf(stderr, "WORKER %d> %d batches of %.1f blocks on average, %d hubs", id, scheduler->batchCount,
+				scheduler->batchCount > 0 ? (double)scheduler->batchBlockCount / scheduler->batchCount : 0, scheduler->hubLength);
+		}
+		fprintf(stderr, ", busiest thread %.1f%% above average, %s kernel with %s weights\n", average > 0 ? (busiest / average - 1) * 100 : 0,
+			metisKernelName(), model->quantizedSensitivities == NULL ? "double" : model->quantizedBytes == 1 ? "int8" : "int16");
+		if (worker->lanes > 1) {
+			fprintf(stderr, "WORKER %d> Simulated %d scenarios side by side\n", id, worker->lanes);
+		}
+		fprintf(stderr, "WORKER %d> Inputs stored as %s, %.2f entries per input\n", id, metisFormatName(worker->matrix->format),
+			worker->matrix->connections > 0 ? (double)worker->matrix->entries / worker->matrix->connections : 0);
+		metisReportSockets(worker);
+		if (worker->trace != NULL) {
+			metisTrace* trace = worker->trace;
+			fprintf(stderr, "WORKER %d> Waited %.6f s on the trace with %d buffers, %lld bytes of time steps written as %lld (%.1fx)\n", id,
+				trace->waitTime, options->traceBuffers, trace->rawBytes, trace->encodedBytes,
+				trace->encodedBytes > 0 ? (double)trace->rawBytes / trace->encodedBytes : 0);
+		}
+		if (worker->stream != NULL) {
+			fprintf(stderr, "WORKER %d> Streamed %lld frames, dropped %lld for slow consumers\n", id, worker->stream->sentFrames,
+				worker->stream->droppedFrames);
+		}
+	}
+
+	metisFreeMatrix(worker->matrix);
+	metisFreeScheduler(worker->scheduler);
+	free(worker->hubProducts);
+	free(worker->threadSockets);
+	metisFreePool(worker->pool);
+	free(worker->neuronSlot);
+	free(worker->ownerId);
+	free(worker->activityLevel);
+	free(worker->nextValue);
+	free(worker->peerActivity);
+	if (worker->recorders != NULL) {
+		metisCloseRecorders(worker->recorders, worker->recorderLength);
+	}
+	if (worker->trace != NULL) {
+		metisFreeTrace(worker->trace);
+	}
+	if (worker->stream != NULL) {
+		metisCloseStream(worker->stream);
+	}
+	free(nodes);
+	MPI_Win_unlock_all(worker->activityWindow);
+	MPI_Win_free(&worker->activityWindow);
+}
+
+MPI_Win metisCreateActivityWindow(MPI_Comm nodeComm, int length, int** activity) {
+	MPI_Win window;
+
+	MPI_Win_allocate_shared(sizeof(int) * length, sizeof(int), MPI_INFO_NULL, nodeComm, activity, &window);
+
+	// Nothing is published until the first time step has been handled
+	if (length > 0) {
+		(*activity)[0] = -1;
+	}
+
+	// Make sure no worker reads a slice before its owner has initialized it
+	MPI_Barrier(nodeComm);
+
+	return window;
 }
 
 cJSON* parseFile(char* filename) {
@@ -853,9 +1734,6 @@ metisNeuron* metisNewNeuron() {
 	newNeuron->connections = NULL;
 	newNeuron->connectionsLength = 0;
 	newNeuron->next = NULL;
-	newNeuron->ownerId = -1;
-	newNeuron->nextValue = -1;
-	newNeuron->activityLevel = -1;
 
 	return newNeuron;
 }
@@ -0,0 +1,282 @@
+#ifndef METIS_H
+#define METIS_H
+
+#include <mpi.h>
+#include <stdbool.h>
+#include "cJSON.h"
+#include "format.h"
+#include "kernel.h"
+#include "pool.h"
+#include "schedule.h"
+#include "stream.h"
+#include "text.h"
+#include "trace.h"
+
+#define METIS_MAX_NUERON_NAME 20
+#define METIS_MAX_IO_NAME 20
+#define METIX_MAX_IO_OUTPUT_PREFIX 20
+
+#define MASTER 0
+
+#define DEBUG 0
+
+// Message Types
+#define METIS_DATA_REQUEST		1
+#define METIS_TASK				2
+#define METIS_TIME_UPDATE		3
+#define METIS_TASK_DONE			4
+#define METIS_DATA_RESPONSE		5
+#define METIS_CONFIG			6
+#define METIS_HALO				7
+#define METIS_CUT				8
+
+// Update directions of the active set engine
+#define METIS_PULL 0
+#define METIS_PUSH 1
+#define METIS_AUTO 2
+
+struct metisNeuron;
+struct metisNeuronConnection;
+struct metisIoConnection;
+struct metisIO;
+struct metisConfig;
+
+typedef struct metisNeuronConnection {
+	struct metisNeuron* neuron;
+	double sensitivity;
+	struct metisNeuronConnection* next;
+} metisNeuronConnection;
+
+typedef struct metisIoConnection {
+	struct metisNeuron* neuron;
+	struct metisIoConnection* next;
+} metisIoConnection;
+
+typedef struct metisNeuron {
+	char name[METIS_MAX_NUERON_NAME];
+	struct metisNeuronConnection* connections;
+	int connectionsLength;
+	int id;
+	struct metisNeuron* next;
+} metisNeuron;
+
+typedef struct metisIO {
+	char name[METIS_MAX_IO_NAME];
+	int type;								// 0 = stimulus, 1 = reader
+	metisIoConnection* connections;
+	struct metisIO* next;
+	int connectionsLength;
+	int offset;
+	int duration;
+	int amplitude;
+	char outputPrefix[METIX_MAX_IO_OUTPUT_PREFIX];
+} metisIO;
+
+typedef struct metisConfig {
+	metisNeuron* neurons;
+	int neuronLength;
+	metisIO* io;
+	int ioLength;
+	int simulationLength;
+} metisConfig;
+
+// Flattened io device, its neurons are ioConnections[connectionOffset ... connectionOffset + connectionsLength]
+typedef struct metisModelIO {
+	char name[METIS_MAX_IO_NAME];
+	int type;								// 0 = stimulus, 1 = reader
+	int connectionOffset;
+	int connectionsLength;
+	int offset;
+	int duration;
+	int amplitude;
+	char outputPrefix[METIX_MAX_IO_OUTPUT_PREFIX];
+} metisModelIO;
+
+// Sizes of the sections of a flattened model, stored at the start of its segment
+typedef struct metisModelHeader {
+	int neuronLength;
+	int connectionLength;
+	int ioLength;
+	int ioConnectionLength;
+	int simulationLength;
+	int quantizedScale;						// sensitivities are the quantized weights divided by this, 0 if they can not be
+	int quantizedBytes;						// size of a quantized weight, 1 or 2
+} metisModelHeader;
+
+// Read-only view of a flattened model. The model contains no pointers so a
+// single copy can live in a shared memory segment mapped by every rank on a host.
+// The inputs of neuron i are connectionSources[connectionOffsets[i] ... connectionOffsets[i + 1]]
+// in the order they were listed in the config. If every sensitivity is a whole number of
+// 1 / quantizedScale the model also holds them as small integers for the quantized kernels.
+typedef struct metisModel {
+	int neuronLength;
+	int connectionLength;
+	int ioLength;
+	int ioConnectionLength;
+	int simulationLength;
+	const int* connectionOffsets;
+	const int* connectionSources;
+	const double* connectionSensitivities;
+	const void* quantizedSensitivities;		// int8 or int16 weights, NULL if the model is not quantized
+	int quantizedScale;
+	int quantizedBytes;
+	const char (*neuronNames)[METIS_MAX_NUERON_NAME];
+	const metisModelIO* io;
+	const int* ioConnections;
+	MPI_Win window;
+} metisModel;
+
+// Stimulus schedules simulated side by side, every scenario is one lane of the activity levels
+typedef struct metisScenarios {
+	int length;
+	int* offsets;							// per scenario and io device, offsets[scenario * ioLength + io]
+	int* durations;
+} metisScenarios;
+
+// Stream of the neurons of a reader device that I own
+typedef struct metisRecorder {
+	FILE* file;								// stream of one output prefix
+	int* neurons;
+	int* devices;							// per neuron, the reader in the io of the model it is recorded for
+	int neuronLength;
+	char* buffer;							// stdio buffer of the file
+} metisRecorder;
+
+// Activity levels of every time step added up over the workers, see stats.c
+typedef struct metisStats {
+	FILE* file;								// time series, written by worker 1 only
+	int populationLength;					// reader devices, each one a population
+	int* populationOffsets;					// per population, its neurons I own in populationNeurons
+	int* populationNeurons;
+	int* populationDevices;					// per population, its reader in the io of the model
+	int laneLength;							// counts per lane and time step
+	int bufferLength;
+	long long* local;						// per buffer and lane, my counts
+	long long* total;						// per buffer and lane, the counts of every worker on worker 1
+	int* times;								// per buffer, the time step it holds
+	MPI_Request* requests;					// per buffer, the reduction still using it
+	int time;								// last time step reduced
+} metisStats;
+
+// Settings taken from the command line
+typedef struct metisOptions {
+	char* filename;
+	int threads;							// threads per worker
+	int threadLevel;						// MPI_THREAD_FUNNELED or MPI_THREAD_MULTIPLE
+	bool steal;								// idle threads take blocks from busy ones
+	bool commThread;						// one thread communicates, exchanging halos, while the others compute
+	bool activeSet;							// only recalculate neurons with a changed input, implies commThread
+	int direction;							// METIS_PULL, METIS_PUSH or METIS_AUTO to pick one every time step
+	const char* kernel;						// neuron update kernel, see metisSelectKernel
+	bool quantize;							// use integer weights if the model allows it
+	char* scenarioFile;						// stimulus schedules to simulate in one batch, implies commThread
+	int format;								// METIS_FORMAT_* the inputs of the neurons are stored in
+	bool benchmark;							// time the update in every format instead of simulating
+	int* affinity;							// cpus the threads of a host are pinned to in order, NULL to not pin
+	int affinityLength;
+	bool hugePages;							// back the model and the stored inputs with huge pages
+	int cutDegree;							// neurons with more inputs are split over workers, with more outputs
+											// replicated on every worker, 0 for neither. Implies commThread
+	char* tracePrefix;						// every worker writes its neurons to <prefix>.<worker>.trace, NULL for text
+	char* traceFile;						// every worker writes its neurons to this one file through MPI-IO, NULL for none
+	int aggregators;						// ranks doing the file system writes of traceFile, 0 to let MPI pick
+	char* recordPrefix;						// reader devices write their neurons to <prefix>.<device>.<worker>.txt, NULL for not
+	bool dump;								// rank 1 prints every neuron each time step, unless there is a trace
+	char* statsFile;						// summary of every time step written by worker 1, NULL for none
+	char* streamPath;						// every worker publishes its neurons on the socket <path>.<worker>, NULL for not
+	int traceCodec;							// METIS_CODEC_* of the --trace files
+	int traceBuffers;						// time steps of a trace held for its writer, 1 to write in the simulation
+	char* traceToSim;						// convert the traces with this prefix, or this shared trace, to text and exit
+	int traceStep;							// the one time step traceToSim converts, -1 for every one
+	bool report;							// print timings to stderr when done
+} metisOptions;
+
+// Everything a worker needs to run the simulation of the neurons it owns
+typedef struct metisWorker {
+	metisModel* model;
+	metisOptions* options;
+	metisPool* pool;
+	metisScheduler* scheduler;
+	metisMatrix* matrix;					// inputs of the neuron runs of the scheduler
+	const metisScenarios* scenarios;		// NULL to simulate the stimuli of the model
+	int lanes;								// scenarios simulated at once, activity levels are stored per neuron and lane
+	int id;
+	int numberOfNodes;
+	int time;
+	int* nodes;								// neurons I own in id order
+	int numberOfOwnedNeurons;
+	int maxNumberOfNeuronsPerNode;
+	int* ownerId;							// per neuron, the worker that owns it
+	int* activityLevel;
+	int* nextValue;
+	double* hubProducts;					// per hub input, its weighted activity
+	int* threadSockets;						// per pool thread, the socket it runs on
+	int* neuronSlot;						// per neuron, its index in the nodes[] of its owner
+	int* publishedActivity;
+	MPI_Win activityWindow;
+	int** peerActivity;
+	bool gettingData;
+	metisTrace* trace;						// NULL if rank 1 prints the time steps as text
+	metisRecorder* recorders;				// reader devices with neurons I own
+	int recorderLength;
+	metisStats* stats;						// NULL if no summary is written
+	metisStream* stream;					// NULL if the time steps are not published
+	metisText* text;						// lines rank 1 prints, NULL on the other workers
+	MPI_Comm workerComm;					// every worker, the master left out
+} metisWorker;
+
+cJSON* parseFile(char*);
+bool parseOptions(int, char**, metisOptions*);
+metisConfig* parseConfig(cJSON*);
+void metisAddConnection(metisNeuronConnection*, metisNeuronConnection*);
+void metisAddIoConnection(metisIoConnection*, metisIoConnection*);
+metisNeuronConnection* metisNewNeuronConnection(metisNeuron*, double);
+metisConfig* metisNewConfig();
+metisIO* metisNewIO();
+metisNeuron* metisNewNeuron();
+metisIoConnection* metisNewIoConnection();
+void metisFreeConfig(metisConfig*);
+void metisFreeIO(metisIO*);
+void metisFreeNeuron(metisNeuron*);
+void metisAddNeuronConnection(metisNeuron*, metisNeuronConnection*);
+void metisAddIOConnection(metisIO*, metisIoConnection*);
+void metisConfigAddNeuron(metisConfig*, metisNeuron*);
+void metisConfigAddIO(metisConfig*, metisIO*);
+metisNeuron* metisGetNeuronByName(metisConfig*, char*);
+void metisFreeIoConnections(metisIoConnection*);
+void metisFreeNeuronConnections(metisNeuronConnection*);
+void runMasterNode(metisModel*, int, MPI_Comm);
+void runWorkerNode(metisModel*, const metisScenarios*, metisOptions*, int, int, MPI_Comm, MPI_Comm);
+MPI_Win metisCreateActivityWindow(MPI_Comm, int, int**);
+int metisReduceHub(const metisWorker*, int, int);
+void metisHubProducts(const metisWorker*, const metisBlock*);
+void metisPrintState(const metisWorker*);
+
+// halo.c
+void runHaloWorker(metisWorker*);
+int metisCutSegments(const metisWorker*, int);
+int metisCutSegment(const metisWorker*, int, int, int*, int*);
+
+// scenario.c
+metisScenarios* metisLoadScenarios(char*, const metisModel*);
+void metisFreeScenarios(metisScenarios*);
+bool metisStimulusActive(const metisWorker*, int, int, int);
+
+// record.c
+int metisOpenRecorders(const metisWorker*, const char*, metisRecorder**);
+void metisRecord(const metisWorker*, const metisRecorder*, int);
+void metisCloseRecorders(metisRecorder*, int);
+
+// stats.c
+metisStats* metisOpenStats(const metisWorker*, const char*);
+void metisReduceStats(const metisWorker*, metisStats*);
+void metisCloseStats(const metisWorker*, metisStats*);
+
+// model.c
+metisModel* metisLoadModel(char*, MPI_Comm, bool);
+size_t metisModelSize(metisConfig*);
+void metisFlattenConfig(metisConfig*, void*);
+void metisMapModel(metisModel*, void*);
+void metisFreeModel(metisModel*);
+
+#endif
@@ -0,0 +1,265 @@
+#include <mpi.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "metis.h"
+#include "numa.h"
+
+// Every section of a flattened model starts on its own cache line
+#define METIS_MODEL_ALIGNMENT 64
+// Largest power of ten tried when turning the sensitivities into integers
+#define METIS_MAX_QUANTIZED_SCALE 10000
+
+enum {
+	METIS_SECTION_SENSITIVITIES,
+	METIS_SECTION_QUANTIZED_SENSITIVITIES,
+	METIS_SECTION_CONNECTION_OFFSETS,
+	METIS_SECTION_CONNECTION_SOURCES,
+	METIS_SECTION_NEURON_NAMES,
+	METIS_SECTION_IO,
+	METIS_SECTION_IO_CONNECTIONS,
+	METIS_SECTION_COUNT
+};
+
+static size_t metisAlign(size_t size) {
+	return (size + METIS_MODEL_ALIGNMENT - 1) / METIS_MODEL_ALIGNMENT * METIS_MODEL_ALIGNMENT;
+}
+
+// Calculate where each section starts from the sizes in the header, returns the total size
+static size_t metisModelLayout(const metisModelHeader* header, size_t* sections) {
+	size_t sizes[METIS_SECTION_COUNT];
+	size_t offset = metisAlign(sizeof(metisModelHeader));
+
+	sizes[METIS_SECTION_SENSITIVITIES] = sizeof(double) * header->connectionLength;
+	// Kernels load a whole int for every weight, so there is room for one past the last
+	sizes[METIS_SECTION_QUANTIZED_SENSITIVITIES] = header->quantizedScale > 0 ? (size_t)header->quantizedBytes * header->connectionLength + sizeof(int) : 0;
+	sizes[METIS_SECTION_CONNECTION_OFFSETS] = sizeof(int) * (header->neuronLength + 1);
+	sizes[METIS_SECTION_CONNECTION_SOURCES] = sizeof(int) * header->connectionLength;
+	sizes[METIS_SECTION_NEURON_NAMES] = METIS_MAX_NUERON_NAME * (size_t)header->neuronLength;
+	sizes[METIS_SECTION_IO] = sizeof(metisModelIO) * header->ioLength;
+	sizes[METIS_SECTION_IO_CONNECTIONS] = sizeof(int) * header->ioConnectionLength;
+
+	for (int i = 0; i < METIS_SECTION_COUNT; i++) {
+		sections[i] = offset;
+		offset += metisAlign(sizes[i]);
+	}
+
+	return offset;
+}
+
+static long long metisQuantize(double sensitivity, int scale) {
+	double scaled = sensitivity * scale;
+	return (long long)(scaled >= 0 ? scaled + 0.5 : scaled - 0.5);
+}
+
+// Find the smallest power of ten that turns every sensitivity into an integer of at most
+// 16 bits which converts back into exactly the same double. The integer sum of a neuron
+// has to fit an int, and the rounding error of the double sum has to stay far below
+// 1 / scale, the closest a sum that is not a whole number can get to one.
+// Returns 0 if there is no such scale
+static int metisQuantizeScale(metisConfig* config, int* bytes) {
+	for (int scale = 1; scale <= METIS_MAX_QUANTIZED_SCALE; scale *= 10) {
+		bool exact = true;
+		long long largest = 0;
+
+		for (metisNeuron* cursor = config->neurons; cursor != NULL && exact; cursor = cursor->next) {
+			long long weightSum = 0;
+			for (metisNeuronConnection* connCursor = cursor->connections; connCursor != NULL; connCursor = connCursor->next) {
+				double scaled = connCursor->sensitivity * scale;
+				long long weight = metisQuantize(connCursor->sensitivity, scale);
+				if (scaled > 32767 || scaled < -32767 || (double)weight / scale != connCursor->sensitivity) {
+					exact = false;
+					break;
+				}
+
+				weight = weight < 0 ? -weight : weight;
+				largest = weight > largest ? weight : largest;
+				weightSum += weight;
+			}
+
+			// Activity levels are at most 10
+			double error = (cursor->connectionsLength + 1.0) * weightSum * 10 / 9007199254740992.0;
+			if (weightSum * 10 > 2147483647LL || error >= 0.5) {
+				exact = false;
+			}
+		}
+
+		if (exact) {
+			*bytes = largest <= 127 ? 1 : 2;
+			return scale;
+		}
+	}
+
+	*bytes = 0;
+	return 0;
+}
+
+static void metisModelHeaderFromConfig(metisConfig* config, metisModelHeader* header) {
+	header->neuronLength = config->neuronLength;
+	header->ioLength = config->ioLength;
+	header->simulationLength = config->simulationLength;
+
+	header->connectionLength = 0;
+	for (metisNeuron* cursor = config->neurons; cursor != NULL; cursor = cursor->next) {
+		header->connectionLength += cursor->connectionsLength;
+	}
+
+	header->ioConnectionLength = 0;
+	for (metisIO* cursor = config->io; cursor != NULL; cursor = cursor->next) {
+		header->ioConnectionLength += cursor->connectionsLength;
+	}
+
+	header->quantizedScale = metisQuantizeScale(config, &header->quantizedBytes);
+}
+
+size_t metisModelSize(metisConfig* config) {
+	metisModelHeader header;
+	size_t sections[METIS_SECTION_COUNT];
+
+	metisModelHeaderFromConfig(config, &header);
+
+	return metisModelLayout(&header, sections);
+}
+
+void metisFlattenConfig(metisConfig* config, void* base) {
+	metisModelHeader* header = base;
+	size_t sections[METIS_SECTION_COUNT];
+
+	metisModelHeaderFromConfig(config, header);
+	metisModelLayout(header, sections);
+
+	double* sensitivities = (double*)((char*)base + sections[METIS_SECTION_SENSITIVITIES]);
+	void* quantized = (char*)base + sections[METIS_SECTION_QUANTIZED_SENSITIVITIES];
+	int* connectionOffsets = (int*)((char*)base + sections[METIS_SECTION_CONNECTION_OFFSETS]);
+	int* connectionSources = (int*)((char*)base + sections[METIS_SECTION_CONNECTION_SOURCES]);
+	char (*neuronNames)[METIS_MAX_NUERON_NAME] = (void*)((char*)base + sections[METIS_SECTION_NEURON_NAMES]);
+	metisModelIO* io = (metisModelIO*)((char*)base + sections[METIS_SECTION_IO]);
+	int* ioConnections = (int*)((char*)base + sections[METIS_SECTION_IO_CONNECTIONS]);
+
+	// Neuron ids are their position in the config, so the neuron list is already in id order
+	int connection = 0;
+	for (metisNeuron* cursor = config->neurons; cursor != NULL; cursor = cursor->next) {
+		memcpy(neuronNames[cursor->id], cursor->name, METIS_MAX_NUERON_NAME);
+		connectionOffsets[cursor->id] = connection;
+		for (metisNeuronConnection* connCursor = cursor->connections; connCursor != NULL; connCursor = connCursor->next) {
+			connectionSources[connection] = connCursor->neuron->id;
+			sensitivities[connection] = connCursor->sensitivity;
+			if (header->quantizedBytes == 1) {
+				((signed char*)quantized)[connection] = (signed char)metisQuantize(connCursor->sensitivity, header->quantizedScale);
+			}
+			else if (header->quantizedBytes == 2) {
+				((short*)quantized)[connection] = (short)metisQuantize(connCursor->sensitivity, header->quantizedScale);
+			}
+			connection++;
+		}
+	}
+	connectionOffsets[config->neuronLength] = connection;
+
+	int i = 0;
+	connection = 0;
+	for (metisIO* cursor = config->io; cursor != NULL; cursor = cursor->next) {
+		memcpy(io[i].name, cursor->name, METIS_MAX_IO_NAME);
+		memcpy(io[i].outputPrefix, cursor->outputPrefix, METIX_MAX_IO_OUTPUT_PREFIX);
+		io[i].type = cursor->type;
+		io[i].offset = cursor->offset;
+		io[i].duration = cursor->duration;
+		io[i].amplitude = cursor->amplitude;
+		io[i].connectionOffset = connection;
+		io[i].connectionsLength = cursor->connectionsLength;
+		for (metisIoConnection* ioConnCursor = cursor->connections; ioConnCursor != NULL; ioConnCursor = ioConnCursor->next) {
+			ioConnections[connection] = ioConnCursor->neuron->id;
+			connection++;
+		}
+		i++;
+	}
+}
+
+void metisMapModel(metisModel* model, void* base) {
+	const metisModelHeader* header = base;
+	size_t sections[METIS_SECTION_COUNT];
+
+	metisModelLayout(header, sections);
+
+	model->neuronLength = header->neuronLength;
+	model->connectionLength = header->connectionLength;
+	model->ioLength = header->ioLength;
+	model->ioConnectionLength = header->ioConnectionLength;
+	model->simulationLength = header->simulationLength;
+	model->connectionSensitivities = (const double*)((char*)base + sections[METIS_SECTION_SENSITIVITIES]);
+	model->quantizedScale = header->quantizedScale;
+	model->quantizedBytes = header->quantizedBytes;
+	model->quantizedSensitivities = header->quantizedScale > 0 ? (char*)base + sections[METIS_SECTION_QUANTIZED_SENSITIVITIES] : NULL;
+	model->connectionOffsets = (const int*)((char*)base + sections[METIS_SECTION_CONNECTION_OFFSETS]);
+	model->connectionSources = (const int*)((char*)base + sections[METIS_SECTION_CONNECTION_SOURCES]);
+	model->neuronNames = (const void*)((char*)base + sections[METIS_SECTION_NEURON_NAMES]);
+	model->io = (const metisModelIO*)((char*)base + sections[METIS_SECTION_IO]);
+	model->ioConnections = (const int*)((char*)base + sections[METIS_SECTION_IO_CONNECTIONS]);
+}
+
+metisModel* metisLoadModel(char* filename, MPI_Comm nodeComm, bool hugePages) {
+	int nodeRank;
+	long long size = -1;
+	metisConfig* config = NULL;
+	void* base = NULL;
+
+	MPI_Comm_rank(nodeComm, &nodeRank);
+
+	// Only the first rank on each host parses the file and builds the model
+	if (nodeRank == 0) {
+		cJSON* file = parseFile(filename);
+		if (file == NULL) {
+			fprintf(stderr, "Failed to parse file '%s'\n", filename);
+		}
+		else {
+			config = parseConfig(file);
+		}
+
+		if (config != NULL) {
+			size = metisModelSize(config);
+		}
+	}
+
+	// A size of -1 tells the rest of the host that the model could not be read
+	MPI_Bcast(&size, 1, MPI_LONG_LONG, 0, nodeComm);
+	if (size < 0) {
+		return NULL;
+	}
+
+	metisModel* model = malloc(sizeof(metisModel));
+
+	MPI_Win_allocate_shared(nodeRank == 0 ? size : 0, 1, MPI_INFO_NULL, nodeComm, &base, &model->window);
+	MPI_Win_lock_all(MPI_MODE_NOCHECK, model->window);
+
+	if (nodeRank == 0) {
+		// The advice has to come before the model is written to take effect right away
+		if (hugePages) {
+			metisAdviseHugePages(base, size);
+		}
+		metisFlattenConfig(config, base);
+
+		// The linked config is not needed once the model is flattened
+		metisFreeConfig(config);
+		free(config);
+	}
+
+	// Make sure the model is complete before anyone else on the host reads it
+	MPI_Win_sync(model->window);
+	MPI_Barrier(nodeComm);
+	MPI_Win_sync(model->window);
+
+	if (nodeRank != 0) {
+		MPI_Aint segmentSize;
+		int dispUnit;
+		MPI_Win_shared_query(model->window, 0, &segmentSize, &dispUnit, &base);
+	}
+
+	metisMapModel(model, base);
+
+	return model;
+}
+
+void metisFreeModel(metisModel* model) {
+	MPI_Win_unlock_all(model->window);
+	MPI_Win_free(&model->window);
+	free(model);
+}
@@ -0,0 +1,120 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include "numa.h"
+
+// Read a list of cpus like "0-7,16-23" into a new array and return its length, -1 if it is not valid
+int metisParseCpuList(const char* list, int** cpus) {
+	int capacity = 16;
+	int length = 0;
+	const char* position = list;
+
+	*cpus = malloc(sizeof(int) * capacity);
+	while (*position != '\0') {
+		char* end;
+		long first = strtol(position, &end, 10);
+		long last = first;
+		if (end == position || first < 0) {
+			break;
+		}
+
+		position = end;
+		if (*position == '-') {
+			last = strtol(position + 1, &end, 10);
+			if (end == position + 1 || last < first) {
+				break;
+			}
+			position = end;
+		}
+
+		for (long cpu = first; cpu <= last; cpu++) {
+			if (length == capacity) {
+				capacity *= 2;
+				*cpus = realloc(*cpus, sizeof(int) * capacity);
+			}
+			(*cpus)[length++] = (int)cpu;
+		}
+
+		if (*position == ',') {
+			position++;
+		}
+		else if (*position != '\0') {
+			break;
+		}
+	}
+
+	if (*position != '\0' || length == 0) {
+		free(*cpus);
+		*cpus = NULL;
+		return -1;
+	}
+	return length;
+}
+
+// Keep the calling thread on one cpu, so the memory it touches first stays on its socket
+bool metisPinThread(int cpu) {
+	cpu_set_t set;
+
+	if (cpu < 0 || cpu >= CPU_SETSIZE) {
+		return false;
+	}
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set) == 0;
+}
+
+// Socket of the cpu the calling thread runs on, 0 if the system does not tell
+int metisCurrentSocket() {
+	char path[96];
+	int socket = 0;
+	int cpu = sched_getcpu();
+
+	if (cpu < 0) {
+		return 0;
+	}
+
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+	FILE* file = fopen(path, "r");
+	if (file != NULL) {
+		if (fscanf(file, "%d", &socket) != 1 || socket < 0) {
+			socket = 0;
+		}
+		fclose(file);
+	}
+	return socket;
+}
+
+// Allocate an array that is read over and over. Nothing is written to it, so its pages land
+// on the socket of the thread that touches them first. With huge pages the array is aligned
+// to them and the kernel is asked to back it with huge pages. Release it with free
+void* metisAllocLarge(size_t bytes, bool hugePages) {
+	void* memory = NULL;
+
+	if (!hugePages || bytes < METIS_HUGE_PAGE) {
+		return malloc(bytes);
+	}
+
+	size_t rounded = (bytes + METIS_HUGE_PAGE - 1) / METIS_HUGE_PAGE * METIS_HUGE_PAGE;
+	if (posix_memalign(&memory, METIS_HUGE_PAGE, rounded) != 0) {
+		return malloc(bytes);
+	}
+	metisAdviseHugePages(memory, rounded);
+	return memory;
+}
+
+// Ask for huge pages on the whole huge pages inside a region. It is only advice, a kernel
+// without transparent huge pages keeps the small ones
+void metisAdviseHugePages(void* memory, size_t bytes) {
+	uintptr_t first = ((uintptr_t)memory + METIS_HUGE_PAGE - 1) / METIS_HUGE_PAGE * METIS_HUGE_PAGE;
+	uintptr_t last = ((uintptr_t)memory + bytes) / METIS_HUGE_PAGE * METIS_HUGE_PAGE;
+
+#ifdef MADV_HUGEPAGE
+	if (first < last) {
+		madvise((void*)first, last - first, MADV_HUGEPAGE);
+	}
+#endif
+}
@@ -0,0 +1,16 @@
+#ifndef METIS_NUMA_H
+#define METIS_NUMA_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Transparent huge pages are this large on x86-64, large arrays are aligned to them
+#define METIS_HUGE_PAGE (2 * 1024 * 1024)
+
+int metisParseCpuList(const char*, int**);
+bool metisPinThread(int);
+int metisCurrentSocket();
+void* metisAllocLarge(size_t, bool);
+void metisAdviseHugePages(void*, size_t);
+
+#endif
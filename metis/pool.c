@@ -0,0 +1,125 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "pool.h"
+
+typedef struct metisPoolThread {
+	metisPool* pool;
+	int thread;
+} metisPoolThread;
+
+static void* metisPoolMain(void* arg) {
+	metisPoolThread* self = arg;
+	metisPool* pool = self->pool;
+	int generation = 0;
+
+	while (true) {
+		pthread_mutex_lock(&pool->lock);
+		while (pool->generation == generation && !pool->stop) {
+			pthread_cond_wait(&pool->wake, &pool->lock);
+		}
+		if (pool->stop) {
+			pthread_mutex_unlock(&pool->lock);
+			break;
+		}
+		generation = pool->generation;
+		metisPoolTask task = pool->task;
+		void* taskArg = pool->arg;
+		pthread_mutex_unlock(&pool->lock);
+
+		task(self->thread, pool->threadLength, taskArg);
+
+		pthread_mutex_lock(&pool->lock);
+		pool->running--;
+		if (pool->running == 0) {
+			pthread_cond_signal(&pool->finished);
+		}
+		pthread_mutex_unlock(&pool->lock);
+	}
+
+	free(self);
+	return NULL;
+}
+
+metisPool* metisNewPool(int threadLength) {
+	metisPool* newPool;
+
+	newPool = malloc(sizeof(metisPool));
+
+	// Guarantee all fields are properly cleared
+	newPool->threadLength = threadLength < 1 ? 1 : threadLength;
+	newPool->threads = NULL;
+	newPool->task = NULL;
+	newPool->arg = NULL;
+	newPool->generation = 0;
+	newPool->running = 0;
+	newPool->stop = false;
+	pthread_mutex_init(&newPool->lock, NULL);
+	pthread_cond_init(&newPool->wake, NULL);
+	pthread_cond_init(&newPool->finished, NULL);
+
+	// The calling thread works as thread 0, so only the others are started
+	if (newPool->threadLength > 1) {
+		newPool->threads = malloc(sizeof(pthread_t) * (newPool->threadLength - 1));
+		for (int i = 1; i < newPool->threadLength; i++) {
+			metisPoolThread* self = malloc(sizeof(metisPoolThread));
+			self->pool = newPool;
+			self->thread = i;
+			if (pthread_create(&newPool->threads[i - 1], NULL, metisPoolMain, self) != 0) {
+				fprintf(stderr, "Failed to start pool thread %d, continuing with %d threads\n", i, i);
+				free(self);
+				newPool->threadLength = i;
+				break;
+			}
+		}
+	}
+
+	return newPool;
+}
+
+// Run the task on every thread of the pool and wait for all of them to finish
+void metisPoolRun(metisPool* pool, metisPoolTask task, void* arg) {
+	if (pool->threadLength == 1) {
+		task(0, 1, arg);
+		return;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	pool->task = task;
+	pool->arg = arg;
+	pool->running = pool->threadLength - 1;
+	pool->generation++;
+	pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+
+	task(0, pool->threadLength, arg);
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->running > 0) {
+		pthread_cond_wait(&pool->finished, &pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+// Split length items into contiguous chunks, one per thread
+void metisPoolRange(int length, int thread, int threadLength, int* first, int* last) {
+	*first = (int)((long long)length * thread / threadLength);
+	*last = (int)((long long)length * (thread + 1) / threadLength);
+}
+
+void metisFreePool(metisPool* pool) {
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = true;
+	pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (int i = 1; i < pool->threadLength; i++) {
+		pthread_join(pool->threads[i - 1], NULL);
+	}
+
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->wake);
+	pthread_cond_destroy(&pool->finished);
+	free(pool->threads);
+	free(pool);
+}
@@ -0,0 +1,28 @@
+#ifndef METIS_POOL_H
+#define METIS_POOL_H
+
+#include <pthread.h>
+#include <stdbool.h>
+
+// Work run by every thread of a pool, thread 0 is always the thread that called metisPoolRun
+typedef void (*metisPoolTask)(int thread, int threadLength, void* arg);
+
+typedef struct metisPool {
+	int threadLength;
+	pthread_t* threads;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	pthread_cond_t finished;
+	metisPoolTask task;
+	void* arg;
+	int generation;
+	int running;
+	bool stop;
+} metisPool;
+
+metisPool* metisNewPool(int);
+void metisPoolRun(metisPool*, metisPoolTask, void*);
+void metisPoolRange(int, int, int, int*, int*);
+void metisFreePool(metisPool*);
+
+#endif
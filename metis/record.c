@@ -0,0 +1,132 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "metis.h"
+
+// Records of a reader are written through a buffer this large, so a time step of a few
+// neurons costs no system call and the file system sees large writes
+#define METIS_RECORD_BUFFER (1024 * 1024)
+
+// Turn the output prefix of a reader into the part of a file name it is recorded to, characters
+// that do not belong in a file name are replaced by '_' and an empty prefix becomes "_"
+static void metisRecordName(const char* outputPrefix, char* name) {
+	size_t length = strnlen(outputPrefix, METIX_MAX_IO_OUTPUT_PREFIX);
+
+	for (size_t i = 0; i < length; i++) {
+		char c = outputPrefix[i];
+		name[i] = isalnum((unsigned char)c) || c == '-' || c == '_' ? c : '_';
+	}
+	if (length == 0) {
+		name[length++] = '_';
+	}
+	name[length] = '\0';
+}
+
+// Open a stream for every output prefix of the reader devices connected to neurons I own. The
+// stream of a prefix is <prefix>.<output prefix>.<worker>.txt and holds every reader with that
+// output prefix. Returns the number of streams, -1 if one could not be created
+int metisOpenRecorders(const metisWorker* worker, const char* prefix, metisRecorder** recorders) {
+	const metisModel* model = worker->model;
+	int length = 0;
+
+	*recorders = malloc(sizeof(metisRecorder) * (model->ioLength + 1));
+	for (int io = 0; io < model->ioLength; io++) {
+		const metisModelIO* device = &model->io[io];
+		if (device->type != 1) {
+			continue;
+		}
+
+		char name[METIX_MAX_IO_OUTPUT_PREFIX + 2];
+		metisRecordName(device->outputPrefix, name);
+
+		// Readers whose prefixes end up with the same file name share a stream
+		metisRecorder* recorder = NULL;
+		for (int r = 0; r < length && recorder == NULL; r++) {
+			char other[METIX_MAX_IO_OUTPUT_PREFIX + 2];
+			metisRecordName(model->io[(*recorders)[r].devices[0]].outputPrefix, other);
+			if (strcmp(name, other) == 0) {
+				recorder = &(*recorders)[r];
+			}
+		}
+
+		// Neurons are recorded in the order the readers list them
+		int* neurons = malloc(sizeof(int) * (device->connectionsLength + 1));
+		int neuronLength = 0;
+		for (int j = 0; j < device->connectionsLength; j++) {
+			int neuron = model->ioConnections[device->connectionOffset + j];
+			if (worker->ownerId[neuron] == worker->id) {
+				neurons[neuronLength++] = neuron;
+			}
+		}
+		if (neuronLength == 0) {
+			free(neurons);
+			continue;
+		}
+
+		if (recorder == NULL) {
+			char filename[4096];
+			snprintf(filename, sizeof(filename), "%s.%s.%d.txt", prefix, name, worker->id);
+			FILE* file = fopen(filename, "w");
+			if (file == NULL) {
+				fprintf(stderr, "Failed to create record file '%s'\n", filename);
+				free(neurons);
+				metisCloseRecorders(*recorders, length);
+				return -1;
+			}
+
+			recorder = &(*recorders)[length++];
+			recorder->file = file;
+			recorder->neurons = NULL;
+			recorder->devices = NULL;
+			recorder->neuronLength = 0;
+			recorder->buffer = malloc(METIS_RECORD_BUFFER);
+			setvbuf(file, recorder->buffer, _IOFBF, METIS_RECORD_BUFFER);
+		}
+
+		recorder->neurons = realloc(recorder->neurons, sizeof(int) * (recorder->neuronLength + neuronLength));
+		recorder->devices = realloc(recorder->devices, sizeof(int) * (recorder->neuronLength + neuronLength));
+		for (int i = 0; i < neuronLength; i++) {
+			recorder->neurons[recorder->neuronLength + i] = neurons[i];
+			recorder->devices[recorder->neuronLength + i] = io;
+		}
+		recorder->neuronLength += neuronLength;
+		free(neurons);
+	}
+
+	return length;
+}
+
+// Append the current time step of the neurons of every reader, each line starting with the
+// output prefix of its reader and a tab, then like the lines rank 1 prints
+void metisRecord(const metisWorker* worker, const metisRecorder* recorders, int length) {
+	char line[METIX_MAX_IO_OUTPUT_PREFIX + 1 + METIS_TEXT_LINE];
+
+	for (int r = 0; r < length; r++) {
+		const metisRecorder* recorder = &recorders[r];
+
+		for (int lane = 0; lane < worker->lanes; lane++) {
+			for (int i = 0; i < recorder->neuronLength; i++) {
+				const char* outputPrefix = worker->model->io[recorder->devices[i]].outputPrefix;
+				size_t prefixLength = strnlen(outputPrefix, METIX_MAX_IO_OUTPUT_PREFIX);
+				int neuron = recorder->neurons[i];
+				int value = worker->activityLevel[neuron * worker->lanes + lane];
+
+				memcpy(line, outputPrefix, prefixLength);
+				line[prefixLength] = '\t';
+				char* end = metisFormatLine(line + prefixLength + 1, worker->scenarios == NULL ? -1 : lane, worker->time, neuron, value);
+				fwrite(line, 1, end - line, recorder->file);
+			}
+		}
+	}
+}
+
+void metisCloseRecorders(metisRecorder* recorders, int length) {
+	for (int r = 0; r < length; r++) {
+		fclose(recorders[r].file);
+		free(recorders[r].buffer);
+		free(recorders[r].neurons);
+		free(recorders[r].devices);
+	}
+	free(recorders);
+}
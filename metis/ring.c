@@ -0,0 +1,56 @@
+#include <stdlib.h>
+#include "ring.h"
+
+// The capacity is rounded up to a power of two so positions wrap with a mask
+void metisInitRing(metisRing* ring, unsigned int capacity) {
+	unsigned int size = 2;
+
+	while (size < capacity) {
+		size *= 2;
+	}
+
+	ring->items = malloc(sizeof(metisRingItem) * size);
+	ring->mask = size - 1;
+	ring->head = 0;
+	ring->tail = 0;
+}
+
+// Called by the producer only, returns false if the ring is full
+bool metisRingPush(metisRing* ring, int key, int value) {
+	unsigned int tail = ring->tail;
+	unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+	if (tail - head > ring->mask) {
+		return false;
+	}
+
+	ring->items[tail & ring->mask].key = key;
+	ring->items[tail & ring->mask].value = value;
+
+	// Publish the item only after it has been written
+	__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+
+	return true;
+}
+
+// Called by the consumer only, returns false if the ring is empty
+bool metisRingPop(metisRing* ring, metisRingItem* item) {
+	unsigned int head = ring->head;
+	unsigned int tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+	if (head == tail) {
+		return false;
+	}
+
+	*item = ring->items[head & ring->mask];
+
+	// Hand the slot back to the producer only after it has been read
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+	return true;
+}
+
+void metisFreeRing(metisRing* ring) {
+	free(ring->items);
+	ring->items = NULL;
+}
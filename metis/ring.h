@@ -0,0 +1,30 @@
+#ifndef METIS_RING_H
+#define METIS_RING_H
+
+#include <stdbool.h>
+
+#define METIS_CACHE_LINE 64
+
+typedef struct metisRingItem {
+	int key;
+	int value;
+} metisRingItem;
+
+// Lock-free queue between exactly one producer thread and one consumer thread.
+// Head and tail sit on their own cache lines so the two threads do not fight over them
+typedef struct metisRing {
+	metisRingItem* items;
+	unsigned int mask;
+	char padding0[METIS_CACHE_LINE - sizeof(void*) - sizeof(unsigned int)];
+	unsigned int head;						// next item to pop, written by the consumer
+	char padding1[METIS_CACHE_LINE - sizeof(unsigned int)];
+	unsigned int tail;						// next free item, written by the producer
+	char padding2[METIS_CACHE_LINE - sizeof(unsigned int)];
+} metisRing;
+
+void metisInitRing(metisRing*, unsigned int);
+bool metisRingPush(metisRing*, int, int);
+bool metisRingPop(metisRing*, metisRingItem*);
+void metisFreeRing(metisRing*);
+
+#endif
@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "metis.h"
+
+// Read the stimulus schedules of a batch. The file holds an array of scenarios, each one
+// may list stimuli of the model by name with a new offset and duration:
+//   [{"name": "early", "io": [{"name": "input", "offset": 0, "duration": 3}]}, ...]
+// Stimuli a scenario does not list keep the schedule of the model
+metisScenarios* metisLoadScenarios(char* filename, const metisModel* model) {
+	cJSON* file = parseFile(filename);
+	if (file == NULL) {
+		fprintf(stderr, "Failed to parse file '%s'\n", filename);
+		return NULL;
+	}
+
+	int length = cJSON_IsArray(file) ? cJSON_GetArraySize(file) : 0;
+	if (length == 0 || length > METIS_MAX_LANES) {
+		fprintf(stderr, "Failed to read scenarios! Is the file an array of 1 to %d scenarios?\n", METIS_MAX_LANES);
+		cJSON_Delete(file);
+		return NULL;
+	}
+
+	metisScenarios* scenarios = malloc(sizeof(metisScenarios));
+	scenarios->length = length;
+	scenarios->offsets = malloc(sizeof(int) * length * (model->ioLength + 1));
+	scenarios->durations = malloc(sizeof(int) * length * (model->ioLength + 1));
+
+	int scenario = 0;
+	const cJSON* element = NULL;
+	cJSON_ArrayForEach(element, file) {
+		int* offsets = &scenarios->offsets[scenario * model->ioLength];
+		int* durations = &scenarios->durations[scenario * model->ioLength];
+		for (int io = 0; io < model->ioLength; io++) {
+			offsets[io] = model->io[io].offset;
+			durations[io] = model->io[io].duration;
+		}
+
+		const cJSON* io = cJSON_GetObjectItemCaseSensitive(element, "io");
+		const cJSON* ioElement = NULL;
+		cJSON_ArrayForEach(ioElement, io) {
+			const cJSON* name = cJSON_GetObjectItemCaseSensitive(ioElement, "name");
+			int device = -1;
+			for (int i = 0; cJSON_IsString(name) && i < model->ioLength; i++) {
+				if (model->io[i].type == 0 && strncmp(model->io[i].name, name->valuestring, METIS_MAX_IO_NAME) == 0) {
+					device = i;
+				}
+			}
+			if (device == -1) {
+				fprintf(stderr, "Scenario %d refers to an unknown stimulus! Make sure your json is properly validated\n", scenario);
+				metisFreeScenarios(scenarios);
+				cJSON_Delete(file);
+				return NULL;
+			}
+
+			const cJSON* offset = cJSON_GetObjectItemCaseSensitive(ioElement, "offset");
+			if (cJSON_IsNumber(offset)) {
+				offsets[device] = offset->valueint;
+			}
+			const cJSON* duration = cJSON_GetObjectItemCaseSensitive(ioElement, "duration");
+			if (cJSON_IsNumber(duration)) {
+				durations[device] = duration->valueint;
+			}
+		}
+		scenario++;
+	}
+
+	cJSON_Delete(file);
+
+	return scenarios;
+}
+
+void metisFreeScenarios(metisScenarios* scenarios) {
+	free(scenarios->offsets);
+	free(scenarios->durations);
+	free(scenarios);
+}
+
+// Is a stimulus device on in the given time step of a lane, without scenarios the model decides
+bool metisStimulusActive(const metisWorker* worker, int io, int lane, int time) {
+	const metisModelIO* device = &worker->model->io[io];
+	int offset = device->offset;
+	int duration = device->duration;
+
+	if (device->type != 0) {
+		return false;
+	}
+	if (worker->scenarios != NULL) {
+		offset = worker->scenarios->offsets[lane * worker->model->ioLength + io];
+		duration = worker->scenarios->durations[lane * worker->model->ioLength + io];
+	}
+	return time >= offset && time < offset + duration;
+}
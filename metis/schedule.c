@@ -0,0 +1,374 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "schedule.h"
+#include "util.h"
+
+// Aim for this many blocks per thread so there is something left to steal
+#define METIS_BLOCKS_PER_THREAD 8
+// Smallest cost worth turning into its own block
+#define METIS_MIN_BLOCK_COST 32
+// Largest cost of a block, so the products of a block of the blocked format stay in the L2 cache
+#define METIS_MAX_BLOCK_COST 32768
+
+typedef struct metisSchedulerJob {
+	metisScheduler* scheduler;
+	metisBlockTask task;
+	void* arg;
+} metisSchedulerJob;
+
+static void metisAddBlock(metisScheduler* scheduler, int* capacity, int first, int last, int hub, int edgeFirst, int edgeLast) {
+	if (scheduler->blockLength == *capacity) {
+		*capacity = *capacity * 2 + 16;
+		scheduler->blocks = realloc(scheduler->blocks, sizeof(metisBlock) * *capacity);
+	}
+
+	metisBlock* block = &scheduler->blocks[scheduler->blockLength];
+	block->first = first;
+	block->last = last;
+	block->hub = hub;
+	block->edgeFirst = edgeFirst;
+	block->edgeLast = edgeLast;
+	scheduler->blockLength++;
+}
+
+// A neuron costs its inputs plus one, an edge range of a hub only its inputs
+static int metisBlockCost(const metisBlock* block) {
+	return block->hub != -1 ? block->inputs : block->inputs + block->last - block->first;
+}
+
+// Hand every thread a contiguous share of the blocks with about the same cost, a block goes
+// to the thread whose share contains the middle of the block. The deques point into blocks
+static void metisDealBlocks(metisScheduler* scheduler, const metisBlock* blocks, int blockLength) {
+	int threadLength = scheduler->threadLength;
+	long long total = 0;
+
+	for (int b = 0; b < blockLength; b++) {
+		total += metisBlockCost(&blocks[b]);
+	}
+
+	for (int pass = 0; pass < 2; pass++) {
+		for (int t = 0; t < threadLength; t++) {
+			scheduler->deques[t].length = 0;
+		}
+
+		// The owner pops from the bottom, so store each share in reverse to run it front to back
+		long long done = total;
+		for (int b = blockLength - 1; b >= 0; b--) {
+			int cost = metisBlockCost(&blocks[b]);
+			done -= cost;
+			long long middle = done + cost / 2;
+			int owner = total > 0 ? (int)(middle * threadLength / total) : 0;
+			if (owner >= threadLength) {
+				owner = threadLength - 1;
+			}
+
+			metisDeque* deque = &scheduler->deques[owner];
+			if (pass == 1) {
+				deque->blocks[deque->length] = b;
+			}
+			deque->length++;
+		}
+
+		// The first pass only counts the share of every thread
+		for (int t = 0; pass == 0 && t < threadLength; t++) {
+			metisDeque* deque = &scheduler->deques[t];
+			if (deque->length > deque->capacity) {
+				deque->capacity = deque->length * 2;
+				deque->blocks = realloc(deque->blocks, sizeof(int) * deque->capacity);
+			}
+		}
+	}
+
+	for (int t = 0; t < threadLength; t++) {
+		scheduler->deques[t].top = 0;
+		scheduler->deques[t].bottom = scheduler->deques[t].length;
+	}
+	scheduler->queued = blocks;
+}
+
+// Split length neurons with the given input counts into blocks of roughly equal cost.
+// Neurons with more inputs than a block should cost are hubs and get split into edge ranges,
+// neurons with a negative count are calculated elsewhere and left out of every block
+metisScheduler* metisNewScheduler(const int* costs, int length, int threadLength, bool steal) {
+	metisScheduler* scheduler = malloc(sizeof(metisScheduler));
+	int capacity = 0;
+	long long total = 0;
+
+	scheduler->blocks = NULL;
+	scheduler->blockLength = 0;
+	scheduler->hubLength = 0;
+	scheduler->hubEdgeLength = 0;
+	scheduler->threadLength = threadLength;
+	scheduler->steal = steal;
+	scheduler->costs = malloc(sizeof(int) * (length + 1));
+	memcpy(scheduler->costs, costs, sizeof(int) * length);
+	scheduler->neuronHubs = malloc(sizeof(int) * (length + 1));
+	scheduler->batchBlocks = NULL;
+	scheduler->batchBlockLength = 0;
+	scheduler->batchBlockCapacity = 0;
+	scheduler->batch = malloc(sizeof(int) * (length + 1));
+	scheduler->batchLength = 0;
+	scheduler->batchRunLength = 0;
+	scheduler->batchCount = 0;
+	scheduler->batchBlockCount = 0;
+
+	for (int i = 0; i < length; i++) {
+		if (costs[i] >= 0) {
+			total += costs[i] + 1;
+		}
+	}
+
+	long long target = total / ((long long)threadLength * METIS_BLOCKS_PER_THREAD);
+	if (target < METIS_MIN_BLOCK_COST) {
+		target = METIS_MIN_BLOCK_COST;
+	}
+	if (target > METIS_MAX_BLOCK_COST) {
+		target = METIS_MAX_BLOCK_COST;
+	}
+	scheduler->target = (int)target;
+
+	// First count the hubs so their tables can be sized
+	for (int i = 0; i < length; i++) {
+		if (costs[i] > target) {
+			scheduler->hubLength++;
+		}
+	}
+	scheduler->hubs = malloc(sizeof(int) * (scheduler->hubLength + 1));
+	scheduler->hubEdgeOffsets = malloc(sizeof(int) * (scheduler->hubLength + 1));
+	scheduler->hubBlocks = malloc(sizeof(int) * (scheduler->hubLength + 1));
+
+	int hub = 0;
+	int runFirst = 0;
+	long long runCost = 0;
+	for (int i = 0; i < length; i++) {
+		scheduler->neuronHubs[i] = costs[i] > target ? hub : -1;
+		if (costs[i] < 0) {
+			if (runFirst < i) {
+				metisAddBlock(scheduler, &capacity, runFirst, i, -1, 0, 0);
+			}
+			runFirst = i + 1;
+			runCost = 0;
+			continue;
+		}
+
+		if (costs[i] > target) {
+			// Close the run in front of the hub, then split the hub into edge ranges
+			if (runFirst < i) {
+				metisAddBlock(scheduler, &capacity, runFirst, i, -1, 0, 0);
+			}
+
+			scheduler->hubs[hub] = i;
+			scheduler->hubEdgeOffsets[hub] = scheduler->hubEdgeLength;
+			scheduler->hubEdgeLength += costs[i];
+			scheduler->hubBlocks[hub] = scheduler->blockLength;
+			for (long long edge = 0; edge < costs[i]; edge += target) {
+				long long edgeLast = edge + target < costs[i] ? edge + target : costs[i];
+				metisAddBlock(scheduler, &capacity, i, i + 1, hub, (int)edge, (int)edgeLast);
+			}
+			hub++;
+
+			runFirst = i + 1;
+			runCost = 0;
+			continue;
+		}
+
+		runCost += costs[i] + 1;
+		if (runCost >= target) {
+			metisAddBlock(scheduler, &capacity, runFirst, i + 1, -1, 0, 0);
+			runFirst = i + 1;
+			runCost = 0;
+		}
+	}
+	if (runFirst < length) {
+		metisAddBlock(scheduler, &capacity, runFirst, length, -1, 0, 0);
+	}
+	scheduler->hubEdgeOffsets[hub] = scheduler->hubEdgeLength;
+
+	scheduler->deques = malloc(sizeof(metisDeque) * threadLength);
+	for (int t = 0; t < threadLength; t++) {
+		pthread_mutex_init(&scheduler->deques[t].lock, NULL);
+		scheduler->deques[t].blocks = NULL;
+		scheduler->deques[t].capacity = 0;
+	}
+
+	for (int b = 0; b < scheduler->blockLength; b++) {
+		metisBlock* block = &scheduler->blocks[b];
+		block->inputs = block->edgeLast - block->edgeFirst;
+		for (int i = block->first; i < block->last && block->hub == -1; i++) {
+			block->inputs += costs[i];
+		}
+	}
+	metisDealBlocks(scheduler, scheduler->blocks, scheduler->blockLength);
+
+	scheduler->busyTime = calloc(threadLength, sizeof(double));
+	scheduler->busyInputs = calloc(threadLength, sizeof(long long));
+
+	return scheduler;
+}
+
+static int metisDequePop(metisDeque* deque) {
+	int block = -1;
+
+	pthread_mutex_lock(&deque->lock);
+	if (deque->top < deque->bottom) {
+		deque->bottom--;
+		block = deque->blocks[deque->bottom];
+	}
+	pthread_mutex_unlock(&deque->lock);
+
+	return block;
+}
+
+static int metisDequeSteal(metisDeque* deque) {
+	int block = -1;
+
+	pthread_mutex_lock(&deque->lock);
+	if (deque->top < deque->bottom) {
+		block = deque->blocks[deque->top];
+		deque->top++;
+	}
+	pthread_mutex_unlock(&deque->lock);
+
+	return block;
+}
+
+// Refill every deque with its share of the blocks. No thread may be working on the scheduler
+void metisSchedulerReset(metisScheduler* scheduler) {
+	for (int t = 0; t < scheduler->threadLength; t++) {
+		scheduler->deques[t].top = 0;
+		scheduler->deques[t].bottom = scheduler->deques[t].length;
+	}
+}
+
+static void metisAddBatchBlock(metisScheduler* scheduler, const metisBlock* block) {
+	if (scheduler->batchBlockLength == scheduler->batchBlockCapacity) {
+		scheduler->batchBlockCapacity = scheduler->batchBlockCapacity * 2 + 16;
+		scheduler->batchBlocks = realloc(scheduler->batchBlocks, sizeof(metisBlock) * scheduler->batchBlockCapacity);
+	}
+	scheduler->batchBlocks[scheduler->batchBlockLength++] = *block;
+}
+
+// Fill the deques with a batch of neurons instead of the plan, for an engine that only learns
+// while it runs which neurons can be calculated. The neurons are copied to batch[], a run of
+// neurons in a batch block covers positions of batch[] rather than neurons. Hubs are left out
+// of the runs and go at the end of batch[], each with the edge ranges of its plan. Blocks are
+// made smaller for a small batch so every thread still gets a share. No thread may be working
+// on the scheduler. The deques hold the batch until the next one, a reset refills them with it
+void metisSchedulerBatch(metisScheduler* scheduler, const int* neurons, int length) {
+	long long total = 0;
+	int hubLength = 0;
+
+	for (int i = 0; i < length; i++) {
+		int cost = scheduler->costs[neurons[i]];
+		if (scheduler->neuronHubs[neurons[i]] != -1) {
+			scheduler->batch[length - ++hubLength] = neurons[i];
+		}
+		else {
+			scheduler->batch[i - hubLength] = neurons[i];
+			total += cost + 1;
+		}
+	}
+	scheduler->batchLength = length;
+	scheduler->batchRunLength = length - hubLength;
+
+	long long target = total / ((long long)scheduler->threadLength * METIS_BLOCKS_PER_THREAD);
+	if (target < METIS_MIN_BLOCK_COST) {
+		target = METIS_MIN_BLOCK_COST;
+	}
+	if (target > scheduler->target) {
+		target = scheduler->target;
+	}
+
+	metisBlock block = { .first = 0, .hub = -1, .edgeFirst = 0, .edgeLast = 0, .inputs = 0 };
+	scheduler->batchBlockLength = 0;
+	for (int i = 0; i < scheduler->batchRunLength; i++) {
+		block.inputs += scheduler->costs[scheduler->batch[i]];
+		if (block.inputs + i + 1 - block.first >= target) {
+			block.last = i + 1;
+			metisAddBatchBlock(scheduler, &block);
+			block.first = i + 1;
+			block.inputs = 0;
+		}
+	}
+	if (block.first < scheduler->batchRunLength) {
+		block.last = scheduler->batchRunLength;
+		metisAddBatchBlock(scheduler, &block);
+	}
+
+	for (int i = scheduler->batchRunLength; i < length; i++) {
+		int hub = scheduler->neuronHubs[scheduler->batch[i]];
+		for (int b = scheduler->hubBlocks[hub]; b < scheduler->blockLength && scheduler->blocks[b].hub == hub; b++) {
+			metisAddBatchBlock(scheduler, &scheduler->blocks[b]);
+		}
+	}
+
+	scheduler->batchCount++;
+	scheduler->batchBlockCount += scheduler->batchBlockLength;
+	metisDealBlocks(scheduler, scheduler->batchBlocks, scheduler->batchBlockLength);
+}
+
+// Run the blocks of one thread, then help the others if stealing is on.
+// Every thread of the scheduler has to call this once after a reset or a batch
+void metisSchedulerWork(metisScheduler* scheduler, int thread, metisBlockTask task, void* arg) {
+	int threadLength = scheduler->threadLength;
+	double start = metisSeconds();
+	int block;
+
+	while ((block = metisDequePop(&scheduler->deques[thread])) != -1) {
+		task(&scheduler->queued[block], block, thread, arg);
+		scheduler->busyInputs[thread] += scheduler->queued[block].inputs;
+	}
+
+	// Nothing is added to the deques while blocks run, so once every other deque
+	// has been emptied there is nothing left for this thread to do
+	if (scheduler->steal) {
+		for (int i = 1; i < threadLength; i++) {
+			metisDeque* victim = &scheduler->deques[(thread + i) % threadLength];
+			while ((block = metisDequeSteal(victim)) != -1) {
+				task(&scheduler->queued[block], block, thread, arg);
+				scheduler->busyInputs[thread] += scheduler->queued[block].inputs;
+			}
+		}
+	}
+
+	scheduler->busyTime[thread] += metisSeconds() - start;
+}
+
+static void metisSchedulerThread(int thread, int threadLength, void* arg) {
+	metisSchedulerJob* job = arg;
+
+	(void)threadLength;
+	metisSchedulerWork(job->scheduler, thread, job->task, job->arg);
+}
+
+// Run the task on every block in the deques, the plan or the current batch, each block exactly once
+void metisSchedulerRun(metisScheduler* scheduler, metisPool* pool, metisBlockTask task, void* arg) {
+	metisSchedulerJob job;
+
+	job.scheduler = scheduler;
+	job.task = task;
+	job.arg = arg;
+
+	metisSchedulerReset(scheduler);
+	metisPoolRun(pool, metisSchedulerThread, &job);
+}
+
+void metisFreeScheduler(metisScheduler* scheduler) {
+	for (int t = 0; t < scheduler->threadLength; t++) {
+		pthread_mutex_destroy(&scheduler->deques[t].lock);
+		free(scheduler->deques[t].blocks);
+	}
+	free(scheduler->deques);
+	free(scheduler->blocks);
+	free(scheduler->hubs);
+	free(scheduler->hubEdgeOffsets);
+	free(scheduler->hubBlocks);
+	free(scheduler->neuronHubs);
+	free(scheduler->costs);
+	free(scheduler->batchBlocks);
+	free(scheduler->batch);
+	free(scheduler->busyTime);
+	free(scheduler->busyInputs);
+	free(scheduler);
+}
@@ -0,0 +1,65 @@
+#ifndef METIS_SCHEDULE_H
+#define METIS_SCHEDULE_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include "pool.h"
+
+// A unit of work: either a run of neurons or an edge range of a single hub neuron
+typedef struct metisBlock {
+	int first;								// first neuron of the block
+	int last;								// one past the last neuron of the block
+	int hub;								// hub the edge range belongs to, -1 for a run of neurons
+	int edgeFirst;							// edge range of the hub, relative to its first input
+	int edgeLast;
+	int inputs;								// inputs the block reads
+} metisBlock;
+
+// Blocks waiting to run on one thread. The owner takes blocks from the bottom, thieves from the top
+typedef struct metisDeque {
+	pthread_mutex_t lock;
+	int* blocks;
+	int length;
+	int capacity;
+	int top;
+	int bottom;
+} metisDeque;
+
+typedef struct metisScheduler {
+	metisBlock* blocks;
+	int blockLength;
+	int* hubs;								// neuron of each hub
+	int* hubEdgeOffsets;					// where the edges of each hub start in a buffer holding all hub edges
+	int* hubBlocks;							// per hub, its edge ranges are blocks[hubBlocks[hub] ... hubBlocks[hub + 1]]
+	int* neuronHubs;						// per neuron, the hub it is or -1
+	int* costs;								// per neuron, its input count
+	int target;								// cost of a block, a neuron costing more is a hub
+	int hubLength;
+	int hubEdgeLength;
+	metisBlock* batchBlocks;				// blocks of the current batch, see metisSchedulerBatch
+	int batchBlockLength;
+	int batchBlockCapacity;
+	int* batch;								// neurons of the current batch, the ones run in blocks first
+	int batchLength;
+	int batchRunLength;						// batch[batchRunLength ... batchLength] are hubs
+	int batchCount;							// batches run so far and the blocks they were split into
+	long long batchBlockCount;
+	const metisBlock* queued;				// blocks the deques point into, the plan or the current batch
+	metisDeque* deques;
+	int threadLength;
+	bool steal;
+	double* busyTime;						// seconds each thread spent running blocks
+	long long* busyInputs;					// inputs each thread read in the blocks it ran
+} metisScheduler;
+
+// Work run for one block, index is the position of the block in the scheduler
+typedef void (*metisBlockTask)(const metisBlock* block, int index, int thread, void* arg);
+
+metisScheduler* metisNewScheduler(const int*, int, int, bool);
+void metisSchedulerReset(metisScheduler*);
+void metisSchedulerBatch(metisScheduler*, const int*, int);
+void metisSchedulerWork(metisScheduler*, int, metisBlockTask, void*);
+void metisSchedulerRun(metisScheduler*, metisPool*, metisBlockTask, void*);
+void metisFreeScheduler(metisScheduler*);
+
+#endif
@@ -0,0 +1,162 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "metis.h"
+
+// Counts of a lane in a time step: how many neurons are at each activity level, then
+// the activity levels of every reader added up. Levels below 0 count as 0
+#define METIS_STATS_LEVELS 11
+
+// Reductions still running, a time step only waits on the one METIS_STATS_BUFFERS before it
+#define METIS_STATS_BUFFERS 2
+
+// Prepare the summary of every time step. Worker 1 writes it to filename, one line per
+// time step and scenario with the number of neurons at each level, Level 10 being the
+// saturated ones, the mean level of the model and the mean level of every reader device.
+// Returns NULL if the file could not be created
+metisStats* metisOpenStats(const metisWorker* worker, const char* filename) {
+	const metisModel* model = worker->model;
+	metisStats* stats = malloc(sizeof(metisStats));
+	int rank;
+
+	MPI_Comm_rank(worker->workerComm, &rank);
+	stats->file = NULL;
+	if (rank == 0) {
+		stats->file = fopen(filename, "w");
+		if (stats->file == NULL) {
+			fprintf(stderr, "Failed to create stats file '%s'\n", filename);
+			free(stats);
+			return NULL;
+		}
+	}
+
+	// Every reader is a population, holding the neurons it is connected to that I own
+	stats->populationLength = 0;
+	stats->populationOffsets = malloc(sizeof(int) * (model->ioLength + 1));
+	stats->populationNeurons = malloc(sizeof(int) * (model->ioConnectionLength + 1));
+	stats->populationDevices = malloc(sizeof(int) * (model->ioLength + 1));
+	stats->populationOffsets[0] = 0;
+	for (int io = 0; io < model->ioLength; io++) {
+		const metisModelIO* device = &model->io[io];
+		if (device->type != 1) {
+			continue;
+		}
+
+		int length = stats->populationOffsets[stats->populationLength];
+		for (int j = 0; j < device->connectionsLength; j++) {
+			int neuron = model->ioConnections[device->connectionOffset + j];
+			if (worker->ownerId[neuron] == worker->id) {
+				stats->populationNeurons[length++] = neuron;
+			}
+		}
+		stats->populationDevices[stats->populationLength] = io;
+		stats->populationOffsets[++stats->populationLength] = length;
+	}
+
+	stats->laneLength = METIS_STATS_LEVELS + stats->populationLength;
+	stats->bufferLength = METIS_STATS_BUFFERS;
+	stats->local = malloc(sizeof(long long) * stats->laneLength * worker->lanes * stats->bufferLength);
+	stats->total = malloc(sizeof(long long) * stats->laneLength * worker->lanes * stats->bufferLength);
+	stats->times = malloc(sizeof(int) * stats->bufferLength);
+	stats->requests = malloc(sizeof(MPI_Request) * stats->bufferLength);
+	for (int buffer = 0; buffer < stats->bufferLength; buffer++) {
+		stats->requests[buffer] = MPI_REQUEST_NULL;
+	}
+	stats->time = -1;
+
+	if (stats->file != NULL) {
+		fprintf(stats->file, worker->scenarios != NULL ? "Scenario\tTime" : "Time");
+		for (int level = 0; level < METIS_STATS_LEVELS; level++) {
+			fprintf(stats->file, "\tLevel %d", level);
+		}
+		fprintf(stats->file, "\tMean");
+		for (int p = 0; p < stats->populationLength; p++) {
+			const metisModelIO* device = &model->io[stats->populationDevices[p]];
+			fprintf(stats->file, "\tMean %.*s", METIS_MAX_IO_NAME, device->name);
+		}
+		fprintf(stats->file, "\n");
+	}
+
+	return stats;
+}
+
+// Wait for the reduction of a buffer and let worker 1 write its time step
+static void metisFinishStats(const metisWorker* worker, metisStats* stats, int buffer) {
+	const metisModel* model = worker->model;
+	if (stats->requests[buffer] == MPI_REQUEST_NULL) {
+		return;
+	}
+	MPI_Wait(&stats->requests[buffer], MPI_STATUS_IGNORE);
+	if (stats->file == NULL) {
+		return;
+	}
+
+	for (int lane = 0; lane < worker->lanes; lane++) {
+		const long long* counts = &stats->total[(buffer * worker->lanes + lane) * stats->laneLength];
+		long long sum = 0;
+
+		if (worker->scenarios != NULL) {
+			fprintf(stats->file, "%d\t", lane);
+		}
+		fprintf(stats->file, "%d", stats->times[buffer]);
+		for (int level = 0; level < METIS_STATS_LEVELS; level++) {
+			fprintf(stats->file, "\t%lld", counts[level]);
+			sum += level * counts[level];
+		}
+		fprintf(stats->file, "\t%.4f", (double)sum / model->neuronLength);
+		for (int p = 0; p < stats->populationLength; p++) {
+			int length = model->io[stats->populationDevices[p]].connectionsLength;
+			fprintf(stats->file, "\t%.4f", length > 0 ? (double)counts[METIS_STATS_LEVELS + p] / length : 0);
+		}
+		fprintf(stats->file, "\n");
+	}
+}
+
+// Count the activity levels of the neurons I own in the current time step and start adding
+// them up over the workers. The result is written once the buffer comes around again
+void metisReduceStats(const metisWorker* worker, metisStats* stats) {
+	int lanes = worker->lanes;
+	int buffer = worker->time % stats->bufferLength;
+	metisFinishStats(worker, stats, buffer);
+
+	long long* local = &stats->local[buffer * lanes * stats->laneLength];
+	memset(local, 0, sizeof(long long) * lanes * stats->laneLength);
+	for (int i = 0; i < worker->numberOfOwnedNeurons; i++) {
+		const int* level = &worker->activityLevel[worker->nodes[i] * lanes];
+		for (int lane = 0; lane < lanes; lane++) {
+			local[lane * stats->laneLength + (level[lane] > 0 ? level[lane] : 0)]++;
+		}
+	}
+	for (int p = 0; p < stats->populationLength; p++) {
+		for (int j = stats->populationOffsets[p]; j < stats->populationOffsets[p + 1]; j++) {
+			const int* level = &worker->activityLevel[stats->populationNeurons[j] * lanes];
+			for (int lane = 0; lane < lanes; lane++) {
+				local[lane * stats->laneLength + METIS_STATS_LEVELS + p] += level[lane] > 0 ? level[lane] : 0;
+			}
+		}
+	}
+
+	stats->times[buffer] = worker->time;
+	stats->time = worker->time;
+	MPI_Ireduce(local, &stats->total[buffer * lanes * stats->laneLength], lanes * stats->laneLength, MPI_LONG_LONG, MPI_SUM, 0,
+		worker->workerComm, &stats->requests[buffer]);
+}
+
+// Write the time steps still being reduced in order and free the summary
+void metisCloseStats(const metisWorker* worker, metisStats* stats) {
+	for (int i = 1; i <= stats->bufferLength; i++) {
+		metisFinishStats(worker, stats, (stats->time + i) % stats->bufferLength);
+	}
+
+	if (stats->file != NULL) {
+		fclose(stats->file);
+	}
+	free(stats->populationOffsets);
+	free(stats->populationNeurons);
+	free(stats->populationDevices);
+	free(stats->local);
+	free(stats->total);
+	free(stats->times);
+	free(stats->requests);
+	free(stats);
+}
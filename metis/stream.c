@@ -0,0 +1,174 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "stream.h"
+
+// Listen for consumers on the Unix socket <path>.<worker>. Nothing here ever blocks the
+// simulation: consumers are accepted and sent frames without waiting. Returns NULL if the
+// socket cannot be created
+metisStream* metisOpenStream(const char* path, int worker, int workers, int neuronLength, int simulationLength, int lanes,
+	bool scenarios, const int* nodes, int ownedLength) {
+	metisStream* stream = malloc(sizeof(metisStream));
+	struct sockaddr_un address;
+
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (snprintf(address.sun_path, sizeof(address.sun_path), "%s.%d", path, worker) >= (int)sizeof(address.sun_path)) {
+		fprintf(stderr, "Stream path '%s' is too long for a socket\n", path);
+		free(stream);
+		return NULL;
+	}
+	memcpy(stream->path, address.sun_path, sizeof(stream->path));
+
+	// A socket left behind by an earlier run is replaced
+	unlink(stream->path);
+	stream->socket = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (stream->socket < 0 || bind(stream->socket, (struct sockaddr*)&address, sizeof(address)) != 0 ||
+		listen(stream->socket, METIS_STREAM_CLIENTS) != 0 || fcntl(stream->socket, F_SETFL, O_NONBLOCK) != 0) {
+		fprintf(stderr, "Failed to listen on stream socket '%s': %s\n", stream->path, strerror(errno));
+		if (stream->socket >= 0) {
+			close(stream->socket);
+		}
+		free(stream);
+		return NULL;
+	}
+
+	metisStreamHeader* header = &stream->header;
+	memset(header, 0, sizeof(metisStreamHeader));
+	memcpy(header->magic, METIS_STREAM_MAGIC, sizeof(header->magic));
+	header->worker = worker;
+	header->workers = workers;
+	header->neuronLength = neuronLength;
+	header->simulationLength = simulationLength;
+	header->lanes = lanes;
+	header->scenarios = scenarios;
+	header->ownedLength = ownedLength;
+	stream->nodes = nodes;
+
+	stream->helloLength = sizeof(metisStreamHeader) + sizeof(int) * (size_t)ownedLength;
+	stream->hello = malloc(stream->helloLength);
+	memcpy(stream->hello, header, sizeof(metisStreamHeader));
+	memcpy(stream->hello + sizeof(metisStreamHeader), nodes, sizeof(int) * (size_t)ownedLength);
+	stream->frameLength = sizeof(int) + (size_t)ownedLength * lanes;
+	stream->frame = malloc(stream->frameLength);
+
+	size_t pendingLength = stream->helloLength > stream->frameLength ? stream->helloLength : stream->frameLength;
+	for (int c = 0; c < METIS_STREAM_CLIENTS; c++) {
+		stream->clients[c].socket = -1;
+		stream->clients[c].pending = malloc(pendingLength);
+		stream->clients[c].pendingLength = 0;
+		stream->clients[c].pendingSent = 0;
+	}
+	stream->sentFrames = 0;
+	stream->droppedFrames = 0;
+
+	return stream;
+}
+
+static void metisDropClient(metisStreamClient* client) {
+	close(client->socket);
+	client->socket = -1;
+	client->pendingLength = 0;
+	client->pendingSent = 0;
+}
+
+// Send as much of what is pending as the socket takes right now. Returns false if the
+// consumer is gone
+static bool metisFlushClient(metisStreamClient* client) {
+	while (client->pendingSent < client->pendingLength) {
+		ssize_t sent = send(client->socket, client->pending + client->pendingSent, client->pendingLength - client->pendingSent,
+			MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (sent < 0) {
+			return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+		}
+		client->pendingSent += sent;
+	}
+	client->pendingLength = 0;
+	client->pendingSent = 0;
+	return true;
+}
+
+// Accept the consumers that connected since the last time step, each one is first sent the header
+static void metisAcceptClients(metisStream* stream) {
+	int socket;
+	while ((socket = accept(stream->socket, NULL, NULL)) >= 0) {
+		metisStreamClient* client = NULL;
+		for (int c = 0; c < METIS_STREAM_CLIENTS && client == NULL; c++) {
+			if (stream->clients[c].socket < 0) {
+				client = &stream->clients[c];
+			}
+		}
+		if (client == NULL) {
+			close(socket);
+			continue;
+		}
+
+		client->socket = socket;
+		memcpy(client->pending, stream->hello, stream->helloLength);
+		client->pendingLength = stream->helloLength;
+		client->pendingSent = 0;
+		if (!metisFlushClient(client)) {
+			metisDropClient(client);
+		}
+	}
+}
+
+// Publish the activity levels of my neurons in a time step, activity holds every neuron lane by
+// lane. A consumer that has not taken the whole frame before misses this one instead of holding
+// up the simulation, so it always gets whole frames, just not every one of them
+void metisWriteStream(metisStream* stream, int time, const int* activity) {
+	int lanes = stream->header.lanes;
+
+	metisAcceptClients(stream);
+
+	memcpy(stream->frame, &time, sizeof(int));
+	signed char* block = (signed char*)(stream->frame + sizeof(int));
+	for (int k = 0; k < stream->header.ownedLength; k++) {
+		const int* values = &activity[stream->nodes[k] * lanes];
+		for (int lane = 0; lane < lanes; lane++) {
+			block[k * lanes + lane] = (signed char)values[lane];
+		}
+	}
+
+	for (int c = 0; c < METIS_STREAM_CLIENTS; c++) {
+		metisStreamClient* client = &stream->clients[c];
+		if (client->socket < 0) {
+			continue;
+		}
+		if (!metisFlushClient(client)) {
+			metisDropClient(client);
+			continue;
+		}
+		if (client->pendingLength > 0) {
+			stream->droppedFrames++;
+			continue;
+		}
+
+		memcpy(client->pending, stream->frame, stream->frameLength);
+		client->pendingLength = stream->frameLength;
+		stream->sentFrames++;
+		if (!metisFlushClient(client)) {
+			metisDropClient(client);
+		}
+	}
+}
+
+// Hang up on every consumer and remove the socket. Frames a consumer has only taken part of are lost
+void metisCloseStream(metisStream* stream) {
+	for (int c = 0; c < METIS_STREAM_CLIENTS; c++) {
+		if (stream->clients[c].socket >= 0) {
+			metisDropClient(&stream->clients[c]);
+		}
+		free(stream->clients[c].pending);
+	}
+	close(stream->socket);
+	unlink(stream->path);
+	free(stream->hello);
+	free(stream->frame);
+	free(stream);
+}
@@ -0,0 +1,52 @@
+#ifndef METIS_STREAM_H
+#define METIS_STREAM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define METIS_STREAM_MAGIC "METISSTR"
+
+// Consumers of a stream, more are turned away until one of them leaves
+#define METIS_STREAM_CLIENTS 16
+
+// First thing a consumer reads from the stream of a worker, followed by the ids of the neurons
+// the worker owns in the order of their values. Every time step is then one frame: the time
+// step as an int and a signed byte per owned neuron and lane, lane by lane within a neuron
+typedef struct metisStreamHeader {
+	char magic[8];
+	int worker;
+	int workers;
+	int neuronLength;
+	int simulationLength;
+	int lanes;
+	int scenarios;							// 1 if the lanes are scenarios
+	int ownedLength;
+} metisStreamHeader;
+
+// A consumer and what is left of the last frame it was sent
+typedef struct metisStreamClient {
+	int socket;								// -1 if the slot is free
+	unsigned char* pending;
+	size_t pendingLength;
+	size_t pendingSent;
+} metisStreamClient;
+
+typedef struct metisStream {
+	int socket;								// listening for consumers
+	char path[108];
+	metisStreamHeader header;
+	const int* nodes;
+	unsigned char* hello;					// header and neuron ids
+	size_t helloLength;
+	unsigned char* frame;
+	size_t frameLength;
+	metisStreamClient clients[METIS_STREAM_CLIENTS];
+	long long sentFrames;					// frames sent to a consumer, counted once per consumer
+	long long droppedFrames;				// frames a consumer was too slow for
+} metisStream;
+
+metisStream* metisOpenStream(const char*, int, int, int, int, int, bool, const int*, int);
+void metisWriteStream(metisStream*, int, const int*);
+void metisCloseStream(metisStream*);
+
+#endif
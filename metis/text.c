@@ -0,0 +1,111 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "text.h"
+
+// Every number from 0 to 99 as two digits, so a number is turned into text two digits at a time
+static const char metisDigitPairs[201] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+static char* metisPutText(char* out, const char* text, size_t length) {
+	memcpy(out, text, length);
+	return out + length;
+}
+
+// Write a number in decimal like %d does, returns the end of it
+static char* metisPutInt(char* out, int value) {
+	char digits[10];
+	char* end = digits + sizeof(digits);
+	char* first = end;
+	unsigned int rest = value < 0 ? 0u - (unsigned int)value : (unsigned int)value;
+
+	if (value < 0) {
+		*out++ = '-';
+	}
+	while (rest >= 100) {
+		first -= 2;
+		memcpy(first, &metisDigitPairs[(rest % 100) * 2], 2);
+		rest /= 100;
+	}
+	if (rest >= 10) {
+		first -= 2;
+		memcpy(first, &metisDigitPairs[rest * 2], 2);
+	}
+	else {
+		*--first = (char)('0' + rest);
+	}
+
+	return metisPutText(out, first, end - first);
+}
+
+// Write the line rank 1 prints for a neuron, the same text as
+// "Scenario:%d\tTime:%d\tNeuron:%d\tActivity Level:%d\n" or without the scenario if it is
+// below 0. out needs room for METIS_TEXT_LINE bytes. Returns the end of the line
+char* metisFormatLine(char* out, int scenario, int time, int neuron, int level) {
+	if (scenario >= 0) {
+		out = metisPutText(out, "Scenario:", 9);
+		out = metisPutInt(out, scenario);
+		*out++ = '\t';
+	}
+	out = metisPutText(out, "Time:", 5);
+	out = metisPutInt(out, time);
+	out = metisPutText(out, "\tNeuron:", 8);
+	out = metisPutInt(out, neuron);
+	out = metisPutText(out, "\tActivity Level:", 16);
+	out = metisPutInt(out, level);
+	*out++ = '\n';
+	return out;
+}
+
+// Gather lines for a file descriptor in a buffer of capacity bytes, at least a line long
+metisText* metisNewText(int file, size_t capacity) {
+	metisText* text = malloc(sizeof(metisText));
+	text->file = file;
+	text->capacity = capacity < METIS_TEXT_LINE ? METIS_TEXT_LINE : capacity;
+	text->buffer = malloc(text->capacity);
+	text->length = 0;
+	return text;
+}
+
+// Add a line, writing out the buffer first if the line might not fit
+void metisTextLine(metisText* text, int scenario, int time, int neuron, int level) {
+	if (text->capacity - text->length < METIS_TEXT_LINE) {
+		metisFlushText(text);
+	}
+	text->length = metisFormatLine(text->buffer + text->length, scenario, time, neuron, level) - text->buffer;
+}
+
+// Write out the buffer in as few writes as the file takes
+void metisFlushText(metisText* text) {
+	size_t written = 0;
+	while (written < text->length) {
+		ssize_t result = write(text->file, text->buffer + written, text->length - written);
+		if (result < 0 && errno == EINTR) {
+			continue;
+		}
+		if (result <= 0) {
+			fprintf(stderr, "Failed to write the output: %s\n", strerror(errno));
+			break;
+		}
+		written += result;
+	}
+	text->length = 0;
+}
+
+// Write out what is left and free the buffer, the file stays open
+void metisFreeText(metisText* text) {
+	metisFlushText(text);
+	free(text->buffer);
+	free(text);
+}
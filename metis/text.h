@@ -0,0 +1,27 @@
+#ifndef METIS_TEXT_H
+#define METIS_TEXT_H
+
+#include <stddef.h>
+
+// Room a line of output.sim needs at most, Scenario:, Time:, Neuron: and Activity Level: with
+// every number as long as an int gets
+#define METIS_TEXT_LINE 96
+
+// Lines are gathered in a buffer this large and written to the file once it is full
+#define METIS_TEXT_BUFFER (4 * 1024 * 1024)
+
+// Lines of output.sim on their way to a file descriptor
+typedef struct metisText {
+	int file;
+	char* buffer;
+	size_t length;
+	size_t capacity;
+} metisText;
+
+char* metisFormatLine(char*, int, int, int, int);
+metisText* metisNewText(int, size_t);
+void metisTextLine(metisText*, int, int, int, int);
+void metisFlushText(metisText*);
+void metisFreeText(metisText*);
+
+#endif
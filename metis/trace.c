@@ -0,0 +1,463 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "text.h"
+#include "trace.h"
+#include "tracereader.h"
+#include "util.h"
+
+static void metisTraceName(char* name, size_t length, const char* prefix, int worker) {
+	snprintf(name, length, "%s.%d.trace", prefix, worker);
+}
+
+// Blocks of METIS_CODEC_XOR start with how the rest is stored
+#define METIS_BLOCK_RAW 0
+#define METIS_BLOCK_PACKED 1
+
+static size_t metisPutVarint(unsigned char* out, size_t value) {
+	size_t length = 0;
+	while (value >= 0x80) {
+		out[length++] = (unsigned char)(value | 0x80);
+		value >>= 7;
+	}
+	out[length++] = (unsigned char)value;
+	return length;
+}
+
+static bool metisGetVarint(const unsigned char* in, size_t length, size_t* position, size_t* value) {
+	*value = 0;
+	for (int shift = 0; *position < length && shift < 64; shift += 7) {
+		unsigned char byte = in[(*position)++];
+		*value |= (size_t)(byte & 0x7f) << shift;
+		if ((byte & 0x80) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Code a time step against the one before. Activity levels hardly change from one step to the
+// next, so the levels plus one, 0 to 11, are XORed with the ones before and the result is a
+// list of runs: a varint of (length << 1) for values that did not change, or (length << 1 | 1)
+// followed by the changes packed two to a byte. A run of changes only ends at two unchanged
+// values in a row, one would cost more as a run of its own. Levels that do not fit in a nibble,
+// or a block that does not get smaller, are stored raw. out needs room for 2 * length + 16 bytes.
+// Returns the size of the coded block
+size_t metisEncodeTraceBlock(const signed char* block, const signed char* previous, size_t length, unsigned char* out) {
+	size_t size = 1;
+	size_t i = 0;
+	bool packed = true;
+
+	out[0] = METIS_BLOCK_PACKED;
+	while (i < length && packed && size <= length) {
+		size_t start = i;
+		while (i < length && block[i] == previous[i]) {
+			i++;
+		}
+		if (i > start) {
+			size += metisPutVarint(&out[size], (i - start) << 1);
+			continue;
+		}
+
+		while ((i < length && block[i] != previous[i]) || (i + 1 < length && block[i + 1] != previous[i + 1])) {
+			packed = packed && block[i] >= -1 && block[i] <= 14 && previous[i] >= -1 && previous[i] <= 14;
+			i++;
+		}
+
+		size_t count = i - start;
+		size += metisPutVarint(&out[size], count << 1 | 1);
+		for (size_t j = 0; j < count; j++) {
+			int change = ((block[start + j] + 1) ^ (previous[start + j] + 1)) & 0xf;
+			if (j % 2 == 0) {
+				out[size + j / 2] = (unsigned char)change;
+			}
+			else {
+				out[size + j / 2] |= (unsigned char)(change << 4);
+			}
+		}
+		size += (count + 1) / 2;
+	}
+
+	if (!packed || size > length) {
+		out[0] = METIS_BLOCK_RAW;
+		memcpy(&out[1], block, length);
+		size = length + 1;
+	}
+
+	return size;
+}
+
+// Turn a coded block back into the time step. block holds the time step before and is
+// overwritten with this one. Returns false if the coded block does not fit the time step
+bool metisDecodeTraceBlock(const unsigned char* in, size_t size, signed char* block, size_t length) {
+	if (size == 0) {
+		return false;
+	}
+	if (in[0] == METIS_BLOCK_RAW) {
+		if (size != length + 1) {
+			return false;
+		}
+		memcpy(block, &in[1], length);
+		return true;
+	}
+
+	size_t position = 1;
+	size_t i = 0;
+	while (position < size) {
+		size_t run;
+		if (!metisGetVarint(in, size, &position, &run) || (run >> 1) > length - i) {
+			return false;
+		}
+
+		size_t count = run >> 1;
+		if (run & 1) {
+			if ((count + 1) / 2 > size - position) {
+				return false;
+			}
+			for (size_t j = 0; j < count; j++) {
+				int change = j % 2 == 0 ? in[position + j / 2] & 0xf : in[position + j / 2] >> 4;
+				block[i + j] = (signed char)(((block[i + j] + 1) ^ change) - 1);
+			}
+			position += (count + 1) / 2;
+		}
+		i += count;
+	}
+
+	return i == length;
+}
+
+// Write a time step to the trace file, coded if the trace asks for it
+static void metisWriteBlock(metisTrace* trace, int time, const signed char* block) {
+	size_t length = (size_t)trace->ownedLength * trace->header.lanes;
+
+	if (trace->stepLength < trace->header.simulationLength) {
+		trace->offsets[trace->stepLength++] = ftell(trace->file);
+	}
+	fwrite(&time, sizeof(int), 1, trace->file);
+	trace->rawBytes += length;
+	if (trace->header.codec == METIS_CODEC_NONE) {
+		fwrite(block, 1, length, trace->file);
+		trace->encodedBytes += length;
+		return;
+	}
+
+	if (time % METIS_TRACE_KEY_INTERVAL == 0) {
+		memset(trace->previous, -1, length);
+	}
+	int size = (int)metisEncodeTraceBlock(block, trace->previous, length, trace->encoded);
+	fwrite(&size, sizeof(int), 1, trace->file);
+	fwrite(trace->encoded, 1, size, trace->file);
+	memcpy(trace->previous, block, length);
+	trace->encodedBytes += size;
+}
+
+// Write the time steps handed over by the simulation in order, until the trace is closed
+static void* metisTraceWriter(void* arg) {
+	metisTrace* trace = arg;
+
+	pthread_mutex_lock(&trace->lock);
+	while (true) {
+		while (trace->filledLength == 0 && !trace->closing) {
+			pthread_cond_wait(&trace->filled, &trace->lock);
+		}
+		if (trace->filledLength == 0) {
+			break;
+		}
+
+		// The buffer stays taken until it is written, the simulation only fills free ones
+		int buffer = trace->firstFilled;
+		pthread_mutex_unlock(&trace->lock);
+		metisWriteBlock(trace, trace->times[buffer], trace->buffers[buffer]);
+		pthread_mutex_lock(&trace->lock);
+
+		trace->firstFilled = (trace->firstFilled + 1) % trace->bufferLength;
+		trace->filledLength--;
+		pthread_cond_signal(&trace->emptied);
+	}
+	pthread_mutex_unlock(&trace->lock);
+
+	return NULL;
+}
+
+// Give the trace its buffers. With more than one, a trace file is written by its own thread
+// and a shared trace with nonblocking collective writes, while the simulation goes on
+static void metisStartWriter(metisTrace* trace, int bufferLength) {
+	trace->bufferLength = bufferLength < 1 ? 1 : bufferLength;
+	trace->buffers = malloc(sizeof(signed char*) * trace->bufferLength);
+	trace->times = malloc(sizeof(int) * trace->bufferLength);
+	trace->requests = malloc(sizeof(MPI_Request) * trace->bufferLength);
+	for (int b = 0; b < trace->bufferLength; b++) {
+		trace->buffers[b] = malloc((size_t)trace->ownedLength * trace->header.lanes + 1);
+		trace->requests[b] = MPI_REQUEST_NULL;
+	}
+	trace->firstFilled = 0;
+	trace->filledLength = 0;
+	trace->closing = false;
+	trace->waitTime = 0;
+	trace->threaded = false;
+
+	// The first time step is coded against levels of -1
+	size_t length = (size_t)trace->ownedLength * trace->header.lanes;
+	trace->previous = malloc(length + 1);
+	memset(trace->previous, -1, length + 1);
+	trace->encoded = malloc(2 * length + 16);
+	trace->offsets = malloc(sizeof(long long) * (trace->header.simulationLength + 1));
+	trace->stepLength = 0;
+	trace->rawBytes = 0;
+	trace->encodedBytes = 0;
+
+	if (trace->file != NULL && trace->bufferLength > 1) {
+		pthread_mutex_init(&trace->lock, NULL);
+		pthread_cond_init(&trace->filled, NULL);
+		pthread_cond_init(&trace->emptied, NULL);
+		trace->threaded = pthread_create(&trace->writer, NULL, metisTraceWriter, trace) == 0;
+		if (!trace->threaded) {
+			fprintf(stderr, "Failed to start the trace writer, writing the trace in the simulation\n");
+		}
+	}
+}
+
+// Create the trace file of a worker, <prefix>.<worker>.trace, and write its header
+metisTrace* metisOpenTrace(const char* prefix, int worker, int workers, int neuronLength, int simulationLength, int lanes,
+	bool scenarios, const int* nodes, int ownedLength, int bufferLength, int codec) {
+	char name[4096];
+	metisTraceName(name, sizeof(name), prefix, worker);
+	FILE* file = fopen(name, "wb");
+	if (file == NULL) {
+		fprintf(stderr, "Failed to create trace file '%s'\n", name);
+		return NULL;
+	}
+
+	metisTrace* trace = malloc(sizeof(metisTrace));
+	trace->file = file;
+	trace->shared = MPI_FILE_NULL;
+	trace->slots = MPI_DATATYPE_NULL;
+	trace->nodes = nodes;
+	trace->ownedLength = ownedLength;
+
+	metisTraceHeader* header = &trace->header;
+	memset(header, 0, sizeof(metisTraceHeader));
+	memcpy(header->magic, METIS_TRACE_MAGIC, sizeof(header->magic));
+	header->version = METIS_TRACE_VERSION;
+	header->worker = worker;
+	header->workers = workers;
+	header->neuronLength = neuronLength;
+	header->simulationLength = simulationLength;
+	header->lanes = lanes;
+	header->scenarios = scenarios;
+	header->ownedLength = ownedLength;
+	header->codec = codec;
+	fwrite(header, sizeof(metisTraceHeader), 1, file);
+	fwrite(nodes, sizeof(int), ownedLength, file);
+	metisStartWriter(trace, bufferLength);
+
+	return trace;
+}
+
+// Create one trace shared by every worker of comm. Each time step the workers write their
+// neurons into it together, the view of a worker only shows the bytes of the neurons it owns,
+// so one collective write per time step puts every value in place. With aggregators > 0 that
+// many ranks collect the data and do the writes to the file system for all of them
+metisTrace* metisOpenSharedTrace(const char* filename, MPI_Comm comm, int aggregators, int worker, int workers, int neuronLength,
+	int simulationLength, int lanes, bool scenarios, const int* nodes, int ownedLength, int bufferLength) {
+	MPI_Info info;
+	MPI_Info_create(&info);
+	if (aggregators > 0) {
+		char value[16];
+		snprintf(value, sizeof(value), "%d", aggregators);
+		MPI_Info_set(info, "cb_nodes", value);
+		MPI_Info_set(info, "romio_cb_write", "enable");
+		MPI_Info_set(info, "collective_buffering", "true");
+	}
+
+	MPI_File file;
+	int error = MPI_File_open(comm, filename, MPI_MODE_CREATE | MPI_MODE_WRONLY, info, &file);
+	MPI_Info_free(&info);
+	if (error != MPI_SUCCESS) {
+		fprintf(stderr, "Failed to create trace file '%s'\n", filename);
+		return NULL;
+	}
+	MPI_File_set_size(file, 0);
+
+	metisTrace* trace = malloc(sizeof(metisTrace));
+	trace->file = NULL;
+	trace->shared = file;
+	trace->nodes = nodes;
+	trace->ownedLength = ownedLength;
+
+	metisTraceHeader* header = &trace->header;
+	memset(header, 0, sizeof(metisTraceHeader));
+	memcpy(header->magic, METIS_TRACE_MAGIC, sizeof(header->magic));
+	header->version = METIS_TRACE_VERSION;
+	header->worker = 0;
+	header->workers = workers;
+	header->neuronLength = neuronLength;
+	header->simulationLength = simulationLength;
+	header->lanes = lanes;
+	header->scenarios = scenarios;
+	header->ownedLength = neuronLength;
+	header->codec = METIS_CODEC_NONE;
+	if (worker == 1) {
+		MPI_File_write_at(file, 0, header, sizeof(metisTraceHeader), MPI_BYTE, MPI_STATUS_IGNORE);
+	}
+
+	// My neurons at their place in a time step, the type spans the whole time step so the
+	// view repeats it for the next one
+	int* displacements = malloc(sizeof(int) * (ownedLength + 1));
+	for (int k = 0; k < ownedLength; k++) {
+		displacements[k] = nodes[k] * lanes;
+	}
+	MPI_Datatype owned;
+	MPI_Type_create_indexed_block(ownedLength, lanes, displacements, MPI_BYTE, &owned);
+	MPI_Type_create_resized(owned, 0, (MPI_Aint)neuronLength * lanes, &trace->slots);
+	MPI_Type_commit(&trace->slots);
+	MPI_Type_free(&owned);
+	free(displacements);
+
+	MPI_File_set_view(file, METIS_TRACE_ALIGN, MPI_BYTE, trace->slots, "native", MPI_INFO_NULL);
+	metisStartWriter(trace, bufferLength);
+
+	return trace;
+}
+
+// Append the activity levels of my neurons in a time step, activity holds every neuron lane by lane.
+// With several buffers this only waits when every one of them is still being written
+void metisWriteTrace(metisTrace* trace, int time, const int* activity) {
+	int lanes = trace->header.lanes;
+	int ownedLength = trace->ownedLength;
+	double start = metisSeconds();
+	int buffer = 0;
+
+	if (trace->threaded) {
+		pthread_mutex_lock(&trace->lock);
+		while (trace->filledLength == trace->bufferLength) {
+			pthread_cond_wait(&trace->emptied, &trace->lock);
+		}
+		buffer = (trace->firstFilled + trace->filledLength) % trace->bufferLength;
+		pthread_mutex_unlock(&trace->lock);
+	}
+	else if (trace->file == NULL) {
+		// A buffer is reused once the write started with it bufferLength time steps ago is done
+		buffer = time % trace->bufferLength;
+		MPI_Wait(&trace->requests[buffer], MPI_STATUS_IGNORE);
+	}
+	trace->waitTime += metisSeconds() - start;
+
+	signed char* block = trace->buffers[buffer];
+	for (int k = 0; k < ownedLength; k++) {
+		const int* values = &activity[trace->nodes[k] * lanes];
+		for (int lane = 0; lane < lanes; lane++) {
+			block[k * lanes + lane] = (signed char)values[lane];
+		}
+	}
+
+	if (trace->threaded) {
+		pthread_mutex_lock(&trace->lock);
+		trace->times[buffer] = time;
+		trace->filledLength++;
+		pthread_cond_signal(&trace->filled);
+		pthread_mutex_unlock(&trace->lock);
+	}
+	else if (trace->file != NULL) {
+		start = metisSeconds();
+		metisWriteBlock(trace, time, block);
+		trace->waitTime += metisSeconds() - start;
+	}
+	else if (trace->bufferLength > 1) {
+		// Offsets in the view only count my bytes, which are the same in every time step
+		MPI_File_iwrite_at_all(trace->shared, (MPI_Offset)time * ownedLength * lanes, block, ownedLength * lanes, MPI_BYTE,
+			&trace->requests[buffer]);
+	}
+	else {
+		start = metisSeconds();
+		MPI_File_write_at_all(trace->shared, (MPI_Offset)time * ownedLength * lanes, block, ownedLength * lanes, MPI_BYTE,
+			MPI_STATUS_IGNORE);
+		trace->waitTime += metisSeconds() - start;
+	}
+}
+
+// Write out what is left and close the file. Waiting for this counts as waiting on the trace
+void metisCloseTrace(metisTrace* trace) {
+	double start = metisSeconds();
+
+	if (trace->threaded) {
+		pthread_mutex_lock(&trace->lock);
+		trace->closing = true;
+		pthread_cond_signal(&trace->filled);
+		pthread_mutex_unlock(&trace->lock);
+		pthread_join(trace->writer, NULL);
+		pthread_mutex_destroy(&trace->lock);
+		pthread_cond_destroy(&trace->filled);
+		pthread_cond_destroy(&trace->emptied);
+	}
+	if (trace->file != NULL) {
+		// The index lets a reader go straight to any time step, see tracereader.c
+		metisTraceFooter footer;
+		footer.indexOffset = ftell(trace->file);
+		footer.stepLength = trace->stepLength;
+		footer.keyInterval = METIS_TRACE_KEY_INTERVAL;
+		memcpy(footer.magic, METIS_INDEX_MAGIC, sizeof(footer.magic));
+		fwrite(trace->offsets, sizeof(long long), trace->stepLength, trace->file);
+		fwrite(&footer, sizeof(metisTraceFooter), 1, trace->file);
+		fclose(trace->file);
+	}
+	else {
+		MPI_Waitall(trace->bufferLength, trace->requests, MPI_STATUSES_IGNORE);
+		MPI_File_close(&trace->shared);
+		MPI_Type_free(&trace->slots);
+	}
+	trace->waitTime += metisSeconds() - start;
+}
+
+void metisFreeTrace(metisTrace* trace) {
+	for (int b = 0; b < trace->bufferLength; b++) {
+		free(trace->buffers[b]);
+	}
+	free(trace->buffers);
+	free(trace->previous);
+	free(trace->encoded);
+	free(trace->offsets);
+	free(trace->times);
+	free(trace->requests);
+	free(trace);
+}
+
+// Print a time step as text, the lines rank 1 prints without a trace
+static void metisPrintTraceStep(metisText* out, const metisTraceHeader* header, int time, const signed char* activity) {
+	for (int lane = 0; lane < header->lanes; lane++) {
+		for (int neuron = 0; neuron < header->neuronLength; neuron++) {
+			metisTextLine(out, header->scenarios ? lane : -1, time, neuron, activity[neuron * header->lanes + lane]);
+		}
+	}
+}
+
+// Print the traces with this prefix, or the shared trace of that name, as the text output of the
+// simulation, one line per neuron and time step as rank 1 used to print it. Each neuron has the
+// value of its owner. With a time of 0 or more only that time step is printed
+bool metisTraceToSim(const char* prefix, int time, FILE* out) {
+	metisTraceReader* reader = metisOpenTraceReader(prefix);
+	if (reader == NULL) {
+		return false;
+	}
+
+	fflush(out);
+	metisText* text = metisNewText(fileno(out), METIS_TEXT_BUFFER);
+	int first = time < 0 ? 0 : time;
+	int last = time < 0 ? reader->stepLength - 1 : time;
+	bool valid = true;
+	for (int t = first; t <= last && valid; t++) {
+		const signed char* activity = metisReadTraceStep(reader, t);
+		valid = activity != NULL;
+		if (!valid && t >= reader->stepLength) {
+			fprintf(stderr, "The trace holds time steps 0 to %d\n", reader->stepLength - 1);
+		}
+		else if (valid) {
+			metisPrintTraceStep(text, &reader->header, t, activity);
+		}
+	}
+	metisFreeText(text);
+
+	metisCloseTraceReader(reader);
+	return valid;
+}
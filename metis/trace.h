@@ -0,0 +1,91 @@
+#ifndef METIS_TRACE_H
+#define METIS_TRACE_H
+
+#include <mpi.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#define METIS_TRACE_MAGIC "METISTRC"
+#define METIS_TRACE_VERSION 3
+#define METIS_INDEX_MAGIC "METISIDX"
+
+// How the time steps of a trace file are stored
+#define METIS_CODEC_NONE 0					// a signed byte per neuron and lane
+#define METIS_CODEC_XOR 1					// changes against the time step before, run-length coded and packed in nibbles
+
+// The time steps of a shared trace start this far into the file, so the writes stay aligned
+#define METIS_TRACE_ALIGN 4096
+
+// Every this many time steps a block of METIS_CODEC_XOR is coded against levels of -1 instead of
+// the time step before, so a reader only decodes from there to get to any time step
+#define METIS_TRACE_KEY_INTERVAL 64
+
+// Start of the trace file of a worker, followed by the ids of the neurons it owns in the order
+// of their values. Every time step is then one block: the time step as an int and a signed
+// byte per owned neuron and lane, lane by lane within a neuron. Activity levels are -1 to 10.
+// With METIS_CODEC_XOR the time step is followed by the size of the coded block and the block,
+// see metisEncodeTraceBlock. Once the trace is closed, the file offset of every block follows
+// as a long long, then a metisTraceFooter.
+//
+// A shared trace written by every worker at once has a worker of 0 and owns every neuron. Its
+// time steps start at METIS_TRACE_ALIGN, each one a signed byte per neuron and lane in id order
+typedef struct metisTraceHeader {
+	char magic[8];
+	int version;
+	int worker;								// 0 for a shared trace
+	int workers;
+	int neuronLength;
+	int simulationLength;
+	int lanes;
+	int scenarios;							// 1 if the lanes are scenarios, printed with a Scenario: prefix
+	int ownedLength;
+	int codec;								// METIS_CODEC_*, always none for a shared trace
+} metisTraceHeader;
+
+// End of the trace file of a worker, where its index of the time steps is
+typedef struct metisTraceFooter {
+	long long indexOffset;					// file offset of the block offsets
+	int stepLength;							// blocks in the file and offsets in the index
+	int keyInterval;						// METIS_TRACE_KEY_INTERVAL the blocks were written with
+	char magic[8];							// METIS_INDEX_MAGIC
+} metisTraceFooter;
+
+typedef struct metisTrace {
+	FILE* file;								// NULL for a shared trace
+	MPI_File shared;
+	MPI_Datatype slots;						// bytes of a time step of a shared trace I write
+	metisTraceHeader header;
+	const int* nodes;
+	int ownedLength;
+	signed char* previous;					// last time step written, what the next one is coded against
+	unsigned char* encoded;
+	long long* offsets;						// file offset of every block written, for the index
+	int stepLength;
+	long long rawBytes;						// size of the time steps written before and after coding
+	long long encodedBytes;
+	int bufferLength;						// time steps the simulation can be ahead of the file, 1 to write in place
+	signed char** buffers;
+	int* times;								// per buffer, the time step it holds
+	MPI_Request* requests;					// per buffer, the write of a shared trace still using it
+	int firstFilled;						// buffers handed to the writer thread, oldest first
+	int filledLength;
+	bool closing;
+	bool threaded;							// a writer thread writes the trace file
+	pthread_t writer;
+	pthread_mutex_t lock;
+	pthread_cond_t filled;
+	pthread_cond_t emptied;
+	double waitTime;						// seconds the simulation waited on the trace
+} metisTrace;
+
+metisTrace* metisOpenTrace(const char*, int, int, int, int, int, bool, const int*, int, int, int);
+metisTrace* metisOpenSharedTrace(const char*, MPI_Comm, int, int, int, int, int, int, bool, const int*, int, int);
+void metisWriteTrace(metisTrace*, int, const int*);
+void metisCloseTrace(metisTrace*);
+void metisFreeTrace(metisTrace*);
+bool metisTraceToSim(const char*, int, FILE*);
+size_t metisEncodeTraceBlock(const signed char*, const signed char*, size_t, unsigned char*);
+bool metisDecodeTraceBlock(const unsigned char*, size_t, signed char*, size_t);
+
+#endif
@@ -0,0 +1,276 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "tracereader.h"
+
+static bool metisIsTrace(const metisTraceHeader* header) {
+	return memcmp(header->magic, METIS_TRACE_MAGIC, sizeof(header->magic)) == 0 && header->version == METIS_TRACE_VERSION &&
+		header->ownedLength >= 0 && header->neuronLength >= 0 && header->lanes >= 1 &&
+		(header->codec == METIS_CODEC_NONE || header->codec == METIS_CODEC_XOR);
+}
+
+// Map a trace file and check its header, false if it is not one
+static bool metisMapTrace(const char* name, metisTraceMap* map) {
+	memset(map, 0, sizeof(metisTraceMap));
+	map->blockTime = -1;
+
+	int file = open(name, O_RDONLY);
+	if (file < 0) {
+		return false;
+	}
+	struct stat status;
+	if (fstat(file, &status) == 0 && (size_t)status.st_size >= sizeof(metisTraceHeader)) {
+		void* data = mmap(NULL, status.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+		if (data != MAP_FAILED) {
+			map->data = data;
+			map->size = status.st_size;
+		}
+	}
+	close(file);
+	if (map->data == NULL) {
+		return false;
+	}
+
+	memcpy(&map->header, map->data, sizeof(metisTraceHeader));
+	if (!metisIsTrace(&map->header)) {
+		munmap((void*)map->data, map->size);
+		map->data = NULL;
+		return false;
+	}
+	return true;
+}
+
+static void metisUnmapTrace(metisTraceMap* map) {
+	if (map->data != NULL) {
+		munmap((void*)map->data, map->size);
+	}
+	free(map->index);
+	free(map->block);
+}
+
+// Check that a block starting at offset fits before end, and find where the next one starts
+static bool metisCheckBlock(const metisTraceMap* map, size_t offset, size_t end, size_t length, size_t* next) {
+	size_t head = map->header.codec == METIS_CODEC_NONE ? sizeof(int) : 2 * sizeof(int);
+	if (offset > end || end - offset < head) {
+		return false;
+	}
+
+	size_t size = length;
+	if (map->header.codec != METIS_CODEC_NONE) {
+		int coded;
+		memcpy(&coded, map->data + offset + sizeof(int), sizeof(int));
+		if (coded <= 0) {
+			return false;
+		}
+		size = coded;
+	}
+	if (end - offset - head < size) {
+		return false;
+	}
+
+	*next = offset + head + size;
+	return true;
+}
+
+// Find the block of every time step of the trace file of a worker. A closed trace ends in an
+// index of them, the blocks of a trace that was never closed are looked up one after another
+static bool metisIndexTrace(metisTraceMap* map) {
+	size_t length = (size_t)map->header.ownedLength * map->header.lanes;
+	size_t start = sizeof(metisTraceHeader) + sizeof(int) * (size_t)map->header.ownedLength;
+	if (map->size < start) {
+		return false;
+	}
+	map->nodes = (const int*)(map->data + sizeof(metisTraceHeader));
+	for (int k = 0; k < map->header.ownedLength; k++) {
+		if (map->nodes[k] < 0 || map->nodes[k] >= map->header.neuronLength) {
+			return false;
+		}
+	}
+	map->block = malloc(length + 1);
+
+	metisTraceFooter footer;
+	bool indexed = false;
+	if (map->size - start >= sizeof(metisTraceFooter)) {
+		memcpy(&footer, map->data + map->size - sizeof(metisTraceFooter), sizeof(metisTraceFooter));
+		indexed = memcmp(footer.magic, METIS_INDEX_MAGIC, sizeof(footer.magic)) == 0 && footer.stepLength >= 0 &&
+			footer.keyInterval > 0 && footer.indexOffset >= (long long)start &&
+			(size_t)footer.indexOffset + sizeof(long long) * footer.stepLength + sizeof(metisTraceFooter) == map->size;
+	}
+
+	if (indexed) {
+		map->stepLength = footer.stepLength;
+		map->keyInterval = footer.keyInterval;
+		map->index = malloc(sizeof(long long) * (footer.stepLength + 1));
+		memcpy(map->index, map->data + footer.indexOffset, sizeof(long long) * footer.stepLength);
+		for (int time = 0; time < map->stepLength; time++) {
+			size_t next;
+			if (map->index[time] < (long long)start || !metisCheckBlock(map, map->index[time], footer.indexOffset, length, &next)) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	map->keyInterval = METIS_TRACE_KEY_INTERVAL;
+	map->index = malloc(sizeof(long long) * (map->header.simulationLength + 1));
+	size_t offset = start;
+	size_t next;
+	map->stepLength = 0;
+	while (map->stepLength < map->header.simulationLength && metisCheckBlock(map, offset, map->size, length, &next)) {
+		map->index[map->stepLength++] = offset;
+		offset = next;
+	}
+	return true;
+}
+
+// Open the traces with this prefix, or the shared trace of that name. Returns NULL if they
+// cannot be read or do not belong to the same simulation
+metisTraceReader* metisOpenTraceReader(const char* prefix) {
+	metisTraceReader* reader = calloc(1, sizeof(metisTraceReader));
+	metisTraceMap first;
+	bool valid = true;
+
+	if (metisMapTrace(prefix, &first) && first.header.worker == 0) {
+		size_t step = (size_t)first.header.neuronLength * first.header.lanes;
+		reader->mapLength = 1;
+		reader->maps = malloc(sizeof(metisTraceMap));
+		reader->maps[0] = first;
+		reader->stepLength = first.size > METIS_TRACE_ALIGN && step > 0 ? (first.size - METIS_TRACE_ALIGN) / step : 0;
+		if (reader->stepLength > first.header.simulationLength) {
+			reader->stepLength = first.header.simulationLength;
+		}
+	}
+	else {
+		if (first.data != NULL) {
+			metisUnmapTrace(&first);
+		}
+
+		// The first worker tells how many trace files there are
+		char name[4096];
+		snprintf(name, sizeof(name), "%s.1.trace", prefix);
+		if (!metisMapTrace(name, &first) || first.header.worker != 1) {
+			fprintf(stderr, "'%s' is not a trace file of this version of metis\n", name);
+			metisUnmapTrace(&first);
+			free(reader);
+			return NULL;
+		}
+
+		int workers = first.header.workers > 0 ? first.header.workers : 1;
+		reader->maps = calloc(workers, sizeof(metisTraceMap));
+		reader->maps[0] = first;
+		reader->mapLength = 1;
+		for (int w = 1; w < workers && valid; w++) {
+			snprintf(name, sizeof(name), "%s.%d.trace", prefix, w + 1);
+			valid = metisMapTrace(name, &reader->maps[w]) && reader->maps[w].header.worker == w + 1;
+			reader->mapLength++;
+			if (!valid) {
+				fprintf(stderr, "'%s' is not a trace file of this version of metis\n", name);
+			}
+			else if (reader->maps[w].header.workers != workers || reader->maps[w].header.neuronLength != first.header.neuronLength ||
+				reader->maps[w].header.lanes != first.header.lanes) {
+				fprintf(stderr, "The trace of worker %d belongs to another simulation\n", w + 1);
+				valid = false;
+			}
+		}
+
+		// Only the time steps every worker has written are complete
+		reader->stepLength = first.header.simulationLength;
+		for (int w = 0; w < reader->mapLength && valid; w++) {
+			valid = metisIndexTrace(&reader->maps[w]);
+			if (!valid) {
+				fprintf(stderr, "The trace of worker %d is broken\n", w + 1);
+			}
+			else if (reader->maps[w].stepLength < reader->stepLength) {
+				reader->stepLength = reader->maps[w].stepLength;
+			}
+		}
+	}
+
+	reader->header = reader->maps[0].header;
+	reader->activity = malloc((size_t)reader->header.neuronLength * reader->header.lanes + 1);
+	if (!valid) {
+		metisCloseTraceReader(reader);
+		return NULL;
+	}
+	return reader;
+}
+
+// Decode the block of a time step over the one before, a key block over levels of -1
+static bool metisLoadBlock(metisTraceMap* map, int time) {
+	size_t length = (size_t)map->header.ownedLength * map->header.lanes;
+	const unsigned char* at = map->data + map->index[time];
+	int blockTime;
+
+	memcpy(&blockTime, at, sizeof(int));
+	if (blockTime != time) {
+		return false;
+	}
+	if (map->header.codec == METIS_CODEC_NONE) {
+		memcpy(map->block, at + sizeof(int), length);
+		return true;
+	}
+
+	int size;
+	memcpy(&size, at + sizeof(int), sizeof(int));
+	if (time % map->keyInterval == 0) {
+		memset(map->block, -1, length);
+	}
+	return metisDecodeTraceBlock(at + 2 * sizeof(int), size, map->block, length);
+}
+
+// Bring the last decoded time step of a trace file to this one. Reading the time steps in
+// order decodes one block each, any other one decodes at most keyInterval blocks
+static bool metisSeekBlock(metisTraceMap* map, int time) {
+	int key = time - time % map->keyInterval;
+	int first = map->blockTime >= key && map->blockTime <= time ? map->blockTime + 1 : key;
+
+	for (int t = first; t <= time; t++) {
+		if (!metisLoadBlock(map, t)) {
+			map->blockTime = -1;
+			return false;
+		}
+		map->blockTime = t;
+	}
+	return true;
+}
+
+// The activity levels of every neuron in a time step, lane by lane within a neuron. Neurons
+// are -1 if no worker owned them. Stays valid until the next read, NULL if the time step is
+// not in the trace or a block of it is broken
+const signed char* metisReadTraceStep(metisTraceReader* reader, int time) {
+	int lanes = reader->header.lanes;
+	size_t length = (size_t)reader->header.neuronLength * lanes;
+
+	if (time < 0 || time >= reader->stepLength) {
+		return NULL;
+	}
+	if (reader->header.worker == 0) {
+		return (const signed char*)reader->maps[0].data + METIS_TRACE_ALIGN + time * length;
+	}
+
+	memset(reader->activity, -1, length);
+	for (int w = 0; w < reader->mapLength; w++) {
+		metisTraceMap* map = &reader->maps[w];
+		if (!metisSeekBlock(map, time)) {
+			fprintf(stderr, "The trace of worker %d has a broken block at time step %d\n", w + 1, time);
+			return NULL;
+		}
+		for (int k = 0; k < map->header.ownedLength; k++) {
+			memcpy(&reader->activity[(size_t)map->nodes[k] * lanes], &map->block[(size_t)k * lanes], lanes);
+		}
+	}
+	return reader->activity;
+}
+
+void metisCloseTraceReader(metisTraceReader* reader) {
+	for (int w = 0; w < reader->mapLength; w++) {
+		metisUnmapTrace(&reader->maps[w]);
+	}
+	free(reader->maps);
+	free(reader->activity);
+	free(reader);
+}
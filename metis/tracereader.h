@@ -0,0 +1,35 @@
+#ifndef METIS_TRACEREADER_H
+#define METIS_TRACEREADER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "trace.h"
+
+// One trace file mapped into memory
+typedef struct metisTraceMap {
+	const unsigned char* data;
+	size_t size;
+	metisTraceHeader header;
+	const int* nodes;						// neurons of the worker, in the order of their values
+	long long* index;						// file offset of the block of every time step
+	int stepLength;
+	int keyInterval;						// time steps between blocks coded against levels of -1
+	signed char* block;						// last time step decoded
+	int blockTime;							// -1 if none
+} metisTraceMap;
+
+// Random access to the time steps of the traces of a simulation, either the trace files of
+// every worker or one shared trace
+typedef struct metisTraceReader {
+	metisTraceHeader header;				// of the first file
+	metisTraceMap* maps;
+	int mapLength;
+	int stepLength;							// time steps every file holds
+	signed char* activity;					// every neuron lane by lane, the time step last read
+} metisTraceReader;
+
+metisTraceReader* metisOpenTraceReader(const char*);
+const signed char* metisReadTraceStep(metisTraceReader*, int);
+void metisCloseTraceReader(metisTraceReader*);
+
+#endif
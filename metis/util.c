@@ -0,0 +1,9 @@
+#include <time.h>
+#include "util.h"
+
+// Seconds on a clock that only ever goes forward, for timing parts of the simulation
+double metisSeconds() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec * 1e-9;
+}
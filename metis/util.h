@@ -0,0 +1,6 @@
+#ifndef METIS_UTIL_H
+#define METIS_UTIL_H
+
+double metisSeconds();
+
+#endif
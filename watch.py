@@ -0,0 +1,82 @@
+import socket
+import struct
+import sys
+import time
+
+# Follow a simulation started with --stream <path> and print every time step that reached us
+# from all workers, in the lines of output.sim. Ex. python watch.py /tmp/metis > live.sim
+
+header = struct.Struct("=8s7i")
+
+if len(sys.argv) != 2:
+    print("Missing stream path to watch! Ex. python watch.py <stream path>")
+    exit(1)
+
+
+def connect(name):
+    # The sockets only show up once the workers are running
+    while True:
+        s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        try:
+            s.connect(name)
+            return s
+        except (FileNotFoundError, ConnectionRefusedError):
+            s.close()
+            time.sleep(0.1)
+
+
+def read(s, length):
+    data = b""
+    while len(data) < length:
+        chunk = s.recv(length - len(data))
+        if not chunk:
+            return None
+        data += chunk
+    return data
+
+
+def hello(s):
+    magic, worker, workers, neuronLength, simulationLength, lanes, scenarios, ownedLength = header.unpack(read(s, header.size))
+    if magic != b"METISSTR":
+        print("Not a metis stream!")
+        exit(1)
+    nodes = struct.unpack("=%di" % ownedLength, read(s, 4 * ownedLength))
+    return workers, neuronLength, lanes, scenarios, nodes
+
+
+first = connect(sys.argv[1] + ".1")
+workers, neuronLength, lanes, scenarios, firstNodes = hello(first)
+streams = [first] + [connect(sys.argv[1] + "." + str(w + 1)) for w in range(1, workers)]
+nodes = [firstNodes] + [hello(s)[4] for s in streams[1:]]
+
+# Workers drop the frames of a slow consumer on their own, a time step is only complete if none did
+frames = [dict() for w in range(workers)]
+printed = 0
+missed = 0
+last = -1
+live = list(range(workers))
+while live:
+    for w in list(live):
+        data = read(streams[w], 4 + len(nodes[w]) * lanes)
+        if data is None:
+            live.remove(w)
+            continue
+        frames[w][struct.unpack("=i", data[:4])[0]] = struct.unpack("=%db" % (len(data) - 4), data[4:])
+
+    complete = set(frames[0]).intersection(*frames[1:])
+    for t in sorted(complete):
+        activity = [-1] * (neuronLength * lanes)
+        for w in range(workers):
+            for k, neuron in enumerate(nodes[w]):
+                activity[neuron * lanes:(neuron + 1) * lanes] = frames[w][t][k * lanes:(k + 1) * lanes]
+        for lane in range(lanes):
+            prefix = "Scenario:%d\t" % lane if scenarios else ""
+            for neuron in range(neuronLength):
+                print("%sTime:%d\tNeuron:%d\tActivity Level:%d" % (prefix, t, neuron, activity[neuron * lanes + lane]))
+        missed += t - last - 1
+        printed += 1
+        last = t
+        for w in range(workers):
+            frames[w] = {u: v for u, v in frames[w].items() if u > t}
+
+print("Printed %d time steps, missed %d" % (printed, missed), file=sys.stderr)